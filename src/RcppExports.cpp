@@ -6,6 +6,22 @@
 
 using namespace Rcpp;
 
+// beaumont_log_kernel
+Eigen::VectorXd beaumont_log_kernel(Eigen::MatrixXd proposed, Eigen::MatrixXd previous, Eigen::VectorXd prev_weights, Eigen::VectorXd tau, Eigen::MatrixXd covariance, double tolerance);
+RcppExport SEXP _ABSEIR_beaumont_log_kernel(SEXP proposedSEXP, SEXP previousSEXP, SEXP prev_weightsSEXP, SEXP tauSEXP, SEXP covarianceSEXP, SEXP toleranceSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Eigen::MatrixXd >::type proposed(proposedSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXd >::type previous(previousSEXP);
+    Rcpp::traits::input_parameter< Eigen::VectorXd >::type prev_weights(prev_weightsSEXP);
+    Rcpp::traits::input_parameter< Eigen::VectorXd >::type tau(tauSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXd >::type covariance(covarianceSEXP);
+    Rcpp::traits::input_parameter< double >::type tolerance(toleranceSEXP);
+    rcpp_result_gen = Rcpp::wrap(beaumont_log_kernel(proposed, previous, prev_weights, tau, covariance, tolerance));
+    return rcpp_result_gen;
+END_RCPP
+}
 // calculate_weights_DM
 Eigen::VectorXd calculate_weights_DM(double cur_e, double prev_e, Eigen::MatrixXd eps, Eigen::VectorXd prev_wts);
 RcppExport SEXP _ABSEIR_calculate_weights_DM(SEXP cur_eSEXP, SEXP prev_eSEXP, SEXP epsSEXP, SEXP prev_wtsSEXP) {
@@ -36,6 +52,31 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// decode_transition_counts
+Rcpp::IntegerVector decode_transition_counts(Rcpp::RawVector bytes, Rcpp::IntegerVector dims);
+RcppExport SEXP _ABSEIR_decode_transition_counts(SEXP bytesSEXP, SEXP dimsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::RawVector >::type bytes(bytesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type dims(dimsSEXP);
+    rcpp_result_gen = Rcpp::wrap(decode_transition_counts(bytes, dims));
+    return rcpp_result_gen;
+END_RCPP
+}
+// run_simulation_worker
+double run_simulation_worker(std::string address, int cores, bool once);
+RcppExport SEXP _ABSEIR_run_simulation_worker(SEXP addressSEXP, SEXP coresSEXP, SEXP onceSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type address(addressSEXP);
+    Rcpp::traits::input_parameter< int >::type cores(coresSEXP);
+    Rcpp::traits::input_parameter< bool >::type once(onceSEXP);
+    rcpp_result_gen = Rcpp::wrap(run_simulation_worker(address, cores, once));
+    return rcpp_result_gen;
+END_RCPP
+}
 
 RcppExport SEXP _rcpp_module_boot_mod_dataModel();
 RcppExport SEXP _rcpp_module_boot_mod_distanceModel();
@@ -47,8 +88,11 @@ RcppExport SEXP _rcpp_module_boot_mod_spatialSEIRModel();
 RcppExport SEXP _rcpp_module_boot_mod_transitionPriors();
 
 static const R_CallMethodDef CallEntries[] = {
+    {"_ABSEIR_beaumont_log_kernel", (DL_FUNC) &_ABSEIR_beaumont_log_kernel, 6},
     {"_ABSEIR_calculate_weights_DM", (DL_FUNC) &_ABSEIR_calculate_weights_DM, 4},
     {"_ABSEIR_solve_for_epsilon", (DL_FUNC) &_ABSEIR_solve_for_epsilon, 6},
+    {"_ABSEIR_decode_transition_counts", (DL_FUNC) &_ABSEIR_decode_transition_counts, 2},
+    {"_ABSEIR_run_simulation_worker", (DL_FUNC) &_ABSEIR_run_simulation_worker, 3},
     {"_rcpp_module_boot_mod_dataModel", (DL_FUNC) &_rcpp_module_boot_mod_dataModel, 0},
     {"_rcpp_module_boot_mod_distanceModel", (DL_FUNC) &_rcpp_module_boot_mod_distanceModel, 0},
     {"_rcpp_module_boot_mod_exposureModel", (DL_FUNC) &_rcpp_module_boot_mod_exposureModel, 0},
@@ -7,12 +7,42 @@
 #include <util.hpp>
 #include "SEIRSimNodes.hpp"
 #include "spatialSEIRModel.hpp"
+#include "remoteWorker.hpp"
 #include <chrono>
+#include <algorithm>
+#include <limits>
 #include <thread>
+#include <time.h>
 using namespace std;
 
-#ifdef SPATIALSEIR_SINGLETHREAD
+static void checkInterruptFn(void* dummy)
+{
+    R_CheckUserInterrupt();
+}
 
+bool pendingInterrupt()
+{
+    return(!(R_ToplevelExec(checkInterruptFn, NULL)));
+}
+
+// Seconds of CPU time used by the calling thread, where the platform can
+// say, so that task costs aren't inflated when workers are preempted
+static double taskClock()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec now;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0)
+    {
+        return(now.tv_sec + 1e-9*now.tv_nsec);
+    }
+#endif
+    return(std::chrono::duration<double>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+
+// Debugging aids. They write to the R console, so must only be called on
+// the R thread, as simulations are under the serial backend.
 void printDMatrix(Eigen::MatrixXd inMat, std::string name)
 {
     Rcpp::Rcout << "Matrix (" << inMat.rows() << ", " << inMat.cols() << "): " << name << "\n";
@@ -102,195 +132,371 @@ void printIVector(Eigen::VectorXi inVec, std::string name)
     }
 
 }
-#endif
-#ifndef SPATIALSEIR_SINGLETHREAD
-// Dummy functions
-void printDMatrix(Eigen::MatrixXd inMat, std::string name)
+
+
+NodeWorker::NodeWorker(NodePool* pl,
+                       int idx,
+                       int sd,
+                       std::shared_ptr<const simulationModelData> dat,
+                       std::shared_ptr<captureSpecification> cspec,
+                       const std::atomic<bool>* cncl)
 {
+    pool = pl;
+    worker_idx = idx;
+    victim_generator.seed(sd);
+    log_ring = std::unique_ptr<logRing>(new logRing());
+    node = std::unique_ptr<SEIR_sim_node>(new SEIR_sim_node(this, sd, dat, cspec, 
+                                                            cncl));
 }
 
-void printDVector(Eigen::VectorXd inVec, std::string name)
+void NodeWorker::runTask(const instruction& task)
 {
+    const double start = taskClock();
+    Eigen::VectorXd params = (task.params -> row(task.param_idx)).transpose();
+    // Each particle owns its row of the results and its slot in the full
+    // results, so neither write needs a lock.
+    if (task.kind == sim_task)
+    {
+        Eigen::VectorXd result = node -> simulate(params, false, 
+                                                 task.eta, task.p_rs).result;
+        if (!(pool -> cancelled))
+        {
+            (*(pool -> result_pointer)).row(task.param_idx) = result.transpose(); 
+            pool -> recordCost(task.param_idx, taskClock() - start);
+            pool -> finishTask(task.param_idx);
+        }
+    }
+    else
+    {
+        simulationResultSet result = node -> simulate(params, true, 
+                                                      task.eta, task.p_rs);
+        if (!(pool -> cancelled))
+        {
+            (*(pool -> result_pointer)).row(task.param_idx) = result.result.transpose(); 
+            (*(pool -> result_complete_pointer))[task.param_idx] = std::move(result);
+            pool -> recordCost(task.param_idx, taskClock() - start);
+            pool -> finishTask(task.param_idx);
+        }
+    }
 }
 
-void printIMatrix(Eigen::MatrixXi inMat, std::string name)
+void NodeWorker::addMessage(logSeverity severity, const std::string& msg)
 {
+    log_ring -> push(severity, msg);
 }
 
-void printIVector(Eigen::VectorXi inVec, std::string name)
+bool NodeWorker::runNext()
 {
+    instruction task;
+    int chunkStart, chunkSize, i;
+    if (pool -> claimKernel(chunkStart, chunkSize))
+    {
+        for (i = chunkStart; i < chunkStart + chunkSize; i++)
+        {
+            if (!(pool -> cancelled))
+            {
+                (*(pool -> kernel))(i);
+            }
+        }
+        pool -> completeTasks(chunkSize);
+        return(true);
+    }
+    if (pool -> claimChunk(worker_idx, victim_generator, 
+                chunkStart, chunkSize))
+    {
+        for (i = chunkStart; i < chunkStart + chunkSize; i++)
+        {
+            runTask(pool -> blockTask(pool -> blockParticle(i)));
+        }
+        pool -> completeTasks(chunkSize);
+        return(true);
+    }
+    if ((pool -> tasks).pop(task))
+    {
+        runTask(task);
+        pool -> completeTasks(1);
+        return(true);
+    }
+    return(false);
 }
 
-#endif
+sharedThreadPool& sharedThreadPool::instance()
+{
+    static sharedThreadPool pool;
+    return(pool);
+}
 
+sharedThreadPool::sharedThreadPool()
+{
+    nWaiting = 0;
+    work_epoch = 0;
+    spin_us = 0;
+    exit = false;
+}
 
-NodeWorker::NodeWorker(NodePool* pl,
-                       int sd,
-                       Eigen::VectorXi s,
-                       Eigen::VectorXi e,
-                       Eigen::VectorXi i,
-                       Eigen::VectorXi r,
-                       Eigen::VectorXd offs,
-                       Eigen::MatrixXi y,
-                       MatrixXb nm,
-                       int dmt,
-                       std::vector<Eigen::MatrixXd> dmv,
-                       std::vector<std::vector<Eigen::MatrixXd> > tdmv,
-                       std::vector<int> tdme,
-                       Eigen::MatrixXd x,
-                       Eigen::MatrixXd x_rs,
-                       std::string mode,
-                       Eigen::MatrixXd ei_prior,
-                       Eigen::MatrixXd ir_prior,
-                       double avgI,
-                       Eigen::VectorXd sp_prior,
-                       Eigen::VectorXd se_prec,
-                       Eigen::VectorXd rs_prec,
-                       Eigen::VectorXd se_mean,
-                       Eigen::VectorXd rs_mean,
-                       double ph,
-                       int dmc,
-                       bool cmltv,
-                       int m)
+void sharedThreadPool::updateSpin()
 {
-    pool = pl;
-    node = std::unique_ptr<SEIR_sim_node>(new SEIR_sim_node(this, sd,s,e,i,
-                         r,offs,y,nm,dmt,dmv,tdmv,tdme,x,x_rs,mode,ei_prior,ir_prior,avgI,
-                         sp_prior,se_prec,rs_prec,se_mean,rs_mean, ph,dmc,cmltv, m));
+    int budget = 0;
+    for (unsigned int i = 0; i < contexts.size(); i++)
+    {
+        budget = std::max(budget, contexts[i] -> spin_us);
+    }
+    spin_us = (spinUseful((int) threads.size()) ? budget : 0);
 }
 
-void NodeWorker::operator()()
+bool sharedThreadPool::spinUseful(int nThreads)
 {
-    instruction task;
-#ifdef SPATIALSEIR_SINGLETHREAD
-    while ((pool -> tasks).size() > 0)
+    // A spinning thread only helps if it isn't taking a core from a 
+    // worker (or from R)
+    const unsigned int cores = std::thread::hardware_concurrency();
+    return(cores == 0 || nThreads + 1 <= (int) cores);
+}
+
+void sharedThreadPool::attach(NodePool* context, int nThreads, bool pin)
+{
+    const workerPlacement& placement = workerPlacement::instance();
+    std::unique_lock<std::mutex> lock(mutex);
+    contexts.push_back(context);
+    if (pin && pinning.empty())
     {
-        task = (pool -> tasks).front();
-        (pool -> nBusy)++;
-        (pool -> tasks).pop_front();
-        if (task.action_type == sim_atom)
+        for (unsigned int i = 0; i < threads.size(); i++)
         {
-            Eigen::VectorXd result = node -> simulate(task.params, false).result;
-            (*(pool -> result_pointer)).row(task.param_idx) = result; 
+            placement.pinWorker(threads[i].native_handle(), i);
         }
-        else if (task.action_type == sim_result_atom)
+    }
+    while ((int) threads.size() < nThreads)
+    {
+        threads.push_back(std::thread(&sharedThreadPool::workerLoop, this, 
+                                      (int) threads.size()));
+        if (!pinning.empty())
         {
-            // Do these need to be re-sorted?
-            simulationResultSet result = node -> simulate(task.params, true);
-            (*(pool -> result_pointer)).row(task.param_idx) = result.result; 
-            pool -> result_complete_pointer -> push_back(result);
-            pool -> index_pointer -> push_back(task.param_idx);
+            placement.pinWorker(threads.back().native_handle(), 
+                                (int) threads.size() - 1);
         }
-        (pool -> nBusy)--;
     }
-#else
-    while(true)
+    if (pin)
+    {
+        pinning.push_back(context);
+    }
+    updateSpin();
+}
+
+void sharedThreadPool::detach(NodePool* context)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    contexts.erase(std::remove(contexts.begin(), contexts.end(), context), 
+                   contexts.end());
+    const std::size_t nPinning = pinning.size();
+    pinning.erase(std::remove(pinning.begin(), pinning.end(), context), 
+                  pinning.end());
+    if (nPinning > 0 && pinning.empty())
     {
+        // Later models get the threads as they were before pinning
+        const workerPlacement& placement = workerPlacement::instance();
+        for (unsigned int i = 0; i < threads.size(); i++)
         {
-            std::unique_lock<std::mutex> lock(pool -> queue_mutex);
+            placement.unpinWorker(threads[i].native_handle());
+        }
+    }
+    updateSpin();
+    while (context -> nActive > 0)
+    {
+        detached.wait(lock);
+    }
+}
 
-            while (!pool -> exit && (pool -> tasks).empty())
-            {
-                (pool -> condition).wait(lock);
-            }
-            if (pool -> exit)
-                return;
-            task = (pool -> tasks).front();
-            (pool -> nBusy)++;
-            (pool -> tasks).pop_front();
+void sharedThreadPool::notify()
+{
+    // Spinning threads watch the epoch rather than the contexts
+    work_epoch++;
+    // Pairs with the fence in workerLoop: either the producer sees a
+    // thread waiting, or that thread sees the work.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (nWaiting > 0)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.notify_all();
+    }
+}
+
+NodePool* sharedThreadPool::findWork(int worker_idx)
+{
+    for (unsigned int i = 0; i < contexts.size(); i++)
+    {
+        if (worker_idx < contexts[i] -> nLocal && contexts[i] -> hasWork())
+        {
+            return(contexts[i]);
         }
-        if (task.action_type == sim_atom)
+    }
+    return(nullptr);
+}
+
+void sharedThreadPool::workerLoop(int worker_idx)
+{
+    NodePool* context;
+    unsigned int epoch;
+    bool woken;
+    // Spin budget adapts to how often spinning finds work: it doubles 
+    // when work arrives while spinning, and halves when the thread parks.
+    int budget = spin_us;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        // Read before searching, so work published after the search 
+        // changes the epoch
+        epoch = work_epoch;
+        context = findWork(worker_idx);
+        if (context == nullptr && spin_us > 0)
         {
-            Eigen::VectorXd result = node -> simulate(task.params, false).result;
+            budget = std::min(std::max(budget, spin_us/SPIN_BUDGET_RANGE), 
+                              (int) spin_us);
+            lock.unlock();
+            woken = spinWait([this, epoch](){ return(work_epoch != epoch); }, 
+                             budget);
+            lock.lock();
+            budget = (woken ? 2*budget : budget/2);
+            if (woken)
             {
-                std::unique_lock<std::mutex> lock(pool -> result_mutex);
-                (*(pool -> result_pointer)).row(task.param_idx) = result; 
-                while (!(node -> messages).empty()) 
-                {
-                    (pool -> messages).push_back((node -> messages).front()); 
-                    (node -> messages).pop_front();
-                }
+                continue;
             }
+            context = findWork(worker_idx);
         }
-        else if (task.action_type == sim_result_atom)
+        if (context == nullptr)
         {
-            simulationResultSet result = node -> simulate(task.params, true);
+            nWaiting++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (!exit && (context = findWork(worker_idx)) == nullptr)
             {
-                std::unique_lock<std::mutex> lock(pool -> result_mutex);
-                pool -> index_pointer -> push_back(task.param_idx);
-                pool -> result_complete_pointer -> push_back(result);
-                (*(pool -> result_pointer)).row(task.param_idx) = result.result; 
-                while (!((node -> messages).empty())) 
-                {
-                    (pool -> messages).push_back((node -> messages).front()); 
-                    (node -> messages).pop_front();
-                }
+                condition.wait(lock);
+            }
+            nWaiting--;
+            if (exit)
+            {
+                return;
             }
         }
-
+        // The context can't be detached while this thread is active in it
+        (context -> nActive)++;
+        lock.unlock();
+        while ((context -> nodes)[worker_idx].runNext())
         {
-            std::unique_lock<std::mutex> lock(pool -> queue_mutex);
-            (pool -> nBusy)--;
-            (pool -> finished).notify_one();
+            // pass
+        }
+        lock.lock();
+        if (--(context -> nActive) == 0)
+        {
+            detached.notify_all();
         }
     }
-#endif
+}
+
+sharedThreadPool::~sharedThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        exit = true;
+        work_epoch++;
+        condition.notify_all();
+    }
+    for (unsigned int i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
 }
 
 NodePool::NodePool(Eigen::MatrixXd* rslt_ptr,
                    std::vector<simulationResultSet>* rslt_c_ptr,
-                   std::vector<int>* idx_ptr,
-                       int threads,
-                       int sd,
-                       Eigen::VectorXi s,
-                       Eigen::VectorXi e,
-                       Eigen::VectorXi i,
-                       Eigen::VectorXi r,
-                       Eigen::VectorXd offs,
-                       Eigen::MatrixXi y,
-                       MatrixXb nm,
-                       int dmt,
-                       std::vector<Eigen::MatrixXd> dmv,
-                       std::vector<std::vector<Eigen::MatrixXd> > tdmv,
-                       std::vector<int> tdme,
-                       Eigen::MatrixXd x,
-                       Eigen::MatrixXd x_rs,
-                       std::string mode,
-                       Eigen::MatrixXd ei_prior,
-                       Eigen::MatrixXd ir_prior,
-                       double avgI,
-                       Eigen::VectorXd sp_prior,
-                       Eigen::VectorXd se_prec,
-                       Eigen::VectorXd rs_prec,
-                       Eigen::VectorXd se_mean,
-                       Eigen::VectorXd rs_mean,
-                       double ph,
-                       int dmc,
-                       bool cmltv,
-                       int m)
+                   int threads,
+                   int sd,
+                   std::shared_ptr<const simulationModelData> dat,
+                   std::shared_ptr<captureSpecification> cspec,
+                   bool pin_workers,
+                   int spin_wait_us,
+                   backendKind kind,
+                   const std::vector<std::string>& remote_workers) 
+    : tasks(TASK_QUEUE_CAPACITY)
 {
+    backend = executionBackend::create(kind);
     result_pointer = rslt_ptr;
     result_complete_pointer = rslt_c_ptr;
-    index_pointer = idx_ptr;
-    exit = false;
-    nBusy = 0;
-#ifdef SPATIALSEIR_SINGLETHREAD
-    // Single threaded mode only needs single worker
-    nodes.push_back(NodeWorker(this,
-                                           sd + 1000*(1),s,e,i,
-                     r,offs,y,nm,dmt,dmv,tdmv,tdme,x,x_rs,mode,ei_prior,ir_prior,avgI,
-                     sp_prior,se_prec,rs_prec,se_mean,rs_mean,ph,dmc,cmltv, m
-                    ));
-#else
-    for (int itr = 0; itr < threads; itr++)
-    {
-        nodes.push_back(std::thread(NodeWorker(this,
-                                               sd + 1000*(itr+1),s,e,i,
-                         r,offs,y,nm,dmt,dmv,tdmv,tdme,x,x_rs,mode,ei_prior,ir_prior,avgI,
-                         sp_prior,se_prec,rs_prec,se_mean,rs_mean,ph,dmc,cmltv, m
-                        )));
+    data = dat;
+    capture = cspec;
+    nPending = 0;
+    nActive = 0;
+    nParked = 0;
+    // Only the shared threads, and the R thread waiting on them, spin
+    spin_us = (kind == backend_threads && sharedThreadPool::spinUseful(threads) ? 
+               std::max(0, spin_wait_us) : 0);
+    cancelled = false;
+    awaited_task = -1;
+    last_drain = std::chrono::steady_clock::now();
+    task_done_capacity = 0;
+    block_params = nullptr;
+    block_first = 0;
+    block_kind = sim_task;
+    kernel_range.cursor = 0;
+    kernel = nullptr;
+    last_interrupt_poll = std::chrono::steady_clock::now();
+    nLocal = backend -> localSlots(threads);
+    // Remote workers which can't be reached are left out, and their share
+    // of the work runs locally.
+    std::vector<std::unique_ptr<remoteConnection> > connections;
+    for (unsigned int i = 0; i < remote_workers.size(); i++)
+    {
+        try
+        {
+            connections.push_back(std::unique_ptr<remoteConnection>(
+                        new remoteConnection(remote_workers[i], *data, 
+                                             sd + 1000000*(i + 1))));
+        }
+        catch (const remoteError& err)
+        {
+            Rcpp::warning("Can't use remote worker " + remote_workers[i] + 
+                          ": " + err.what());
+        }
+    }
+    nThreads = nLocal + (int) connections.size();
+    ranges = std::unique_ptr<workRange[]>(new workRange[nThreads]);
+    for (int itr = 0; itr < nThreads; itr++)
+    {
+        ranges[itr].cursor = 0;
+    }
+    const workerPlacement& placement = workerPlacement::instance();
+    // Only the shared threads are pinned
+    if (pin_workers && kind == backend_threads && placement.numaNodes() > 1)
+    {
+        // Each replica is built by a thread on its node, so that its 
+        // pages are first touched, and allocated, there.
+        const int nReplicas = std::min(nLocal, placement.numaNodes());
+        data_replicas.resize(nReplicas);
+        std::vector<std::thread> builders;
+        for (int node = 0; node < nReplicas; node++)
+        {
+            builders.push_back(std::thread([this, node, &placement](){
+                placement.pinToNode(node);
+                data_replicas[node] = std::make_shared<const simulationModelData>(
+                        *data);
+            }));
+        }
+        for (unsigned int i = 0; i < builders.size(); i++)
+        {
+            builders[i].join();
+        }
+    }
+    nodes.reserve(nLocal);
+    for (int itr = 0; itr < nLocal; itr++)
+    {
+        nodes.emplace_back(this, itr, sd + 1000*(itr+1), 
+                           (data_replicas.empty() ? dat : 
+                            data_replicas[placement.nodeForWorker(itr)]),
+                           cspec, &cancelled);
+    }
+    backend -> attach(this, pin_workers);
+    for (unsigned int i = 0; i < connections.size(); i++)
+    {
+        remotes.push_back(std::unique_ptr<remoteProxy>(new remoteProxy(this, 
+                        nLocal + i, std::move(connections[i]))));
     }
-#endif
 }
 
 void NodePool::setResultsDest(Eigen::MatrixXd* rslt_ptr,
@@ -301,116 +507,573 @@ void NodePool::setResultsDest(Eigen::MatrixXd* rslt_ptr,
 }
 
 
-void NodePool::awaitFinished()
+bool NodePool::awaitFinished()
+{
+    backend -> await(this, -1);
+    drainLog(true);
+    return(!cancelled);
+}
+
+bool NodePool::awaitTask(int param_idx)
+{
+    backend -> await(this, param_idx);
+    drainLog(false);
+    return(!cancelled);
+}
+
+void NodePool::resetCompletion(int n)
+{
+    if (n > task_done_capacity)
+    {
+        task_done = std::unique_ptr<std::atomic<bool>[]>(new std::atomic<bool>[n]);
+        task_cost = std::unique_ptr<double[]>(new double[n]);
+        task_done_capacity = n;
+    }
+    for (int i = 0; i < task_done_capacity; i++)
+    {
+        task_done[i].store(false, std::memory_order_relaxed);
+        task_cost[i] = 0.0;
+    }
+}
+
+void NodePool::recordCost(int param_idx, double seconds)
+{
+    if (param_idx < task_done_capacity)
+    {
+        task_cost[param_idx] = seconds;
+    }
+}
+
+void NodePool::fitCostModel(const Eigen::MatrixXd& params)
+{
+    // A lone worker runs every task whatever the order
+    if (nThreads > 1)
+    {
+        cost_model.fit(params, task_cost.get(), 
+                       std::min((int) params.rows(), task_done_capacity));
+    }
+}
+
+bool NodePool::taskDone(int param_idx)
 {
-#ifdef SPATIALSEIR_SINGLETHREAD
-    nodes[0]();
-#else
+    return(param_idx < task_done_capacity && 
+           task_done[param_idx].load(std::memory_order_acquire));
+}
+
+void NodePool::finishTask(int param_idx)
+{
+    if (param_idx >= task_done_capacity)
+    {
+        return;
+    }
+    task_done[param_idx].store(true, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (awaited_task == param_idx)
     {
         std::unique_lock<std::mutex> lock(queue_mutex);
-        finished.wait(lock, [this](){ resolveMessages();
-                return tasks.empty() && (nBusy == 0); });
+        finished.notify_all();
     }
-#endif
 }
 
-void NodePool::resolveMessages()
+bool NodePool::waitSatisfied(int param_idx)
+{
+    return((param_idx >= 0 && taskDone(param_idx)) || nPending == 0);
+}
+
+void NodePool::park(int param_idx, bool wake_for_work)
 {
+    awaited_task = param_idx;
+    nParked++;
+    // Pairs with the fences in finishTask and wakeParked: either the
+    // worker sees this thread parked and notifies, or the wait sees the
+    // task finished.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    while (!finished.wait_for(lock, std::chrono::milliseconds(INTERRUPT_POLL_MS),
+                [this, param_idx, wake_for_work](){
+                    return(waitSatisfied(param_idx) || 
+                           (wake_for_work && hasWork())); }))
     {
-        std::unique_lock<std::mutex> lock(result_mutex);
-        while (!(messages.empty())) 
+        // Worker logs are printed from this thread while the workers run
+        lock.unlock();
+        drainLog(false);
+        if (!cancelled && pendingInterrupt())
         {
-            Rcpp::Rcout << messages.front() << "\n"; 
-            messages.pop_front();
+            cancel();
         }
+        lock.lock();
     }
+    awaited_task = -1;
+    nParked--;
 }
 
-void NodePool::enqueue(std::string action_type, int param_idx, Eigen::VectorXd params)
+void NodePool::wakeParked()
 {
-    instruction inst;
-    inst.param_idx = param_idx;
-    inst.action_type = action_type;
-    inst.params = params;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (nParked > 0)
     {
         std::unique_lock<std::mutex> lock(queue_mutex);
-        tasks.push_back(inst);
+        finished.notify_all();
     }
-    resolveMessages();
-    condition.notify_one();
 }
 
-NodePool::~NodePool()
+void NodePool::pollInterrupt()
+{
+    const std::chrono::steady_clock::time_point now = 
+        std::chrono::steady_clock::now();
+    if (now - last_interrupt_poll >= std::chrono::milliseconds(INTERRUPT_POLL_MS))
+    {
+        last_interrupt_poll = now;
+        drainLog(false);
+        if (!cancelled && pendingInterrupt())
+        {
+            cancel();
+        }
+    }
+}
+
+void NodePool::cancel()
+{
+    int itr, next, end, abandoned = 0;
+    std::uint64_t cursor;
+    instruction task;
+    cancelled = true;
+    // Claim every unstarted task, leaving only those already running
+    for (itr = 0; itr < nThreads; itr++)
+    {
+        cursor = ranges[itr].cursor.load(std::memory_order_acquire);
+        do
+        {
+            next = (int) (cursor & 0xFFFFFFFF);
+            end = (int) (cursor >> 32);
+        } while (next < end && !ranges[itr].cursor.compare_exchange_weak(cursor, 
+                    ((std::uint64_t) end << 32) | (std::uint32_t) end,
+                    std::memory_order_acq_rel, std::memory_order_acquire));
+        abandoned += std::max(0, end - next);
+    }
+    cursor = kernel_range.cursor.load(std::memory_order_acquire);
+    do
+    {
+        next = (int) (cursor & 0xFFFFFFFF);
+        end = (int) (cursor >> 32);
+    } while (next < end && !kernel_range.cursor.compare_exchange_weak(cursor, 
+                ((std::uint64_t) end << 32) | (std::uint32_t) end,
+                std::memory_order_acq_rel, std::memory_order_acquire));
+    abandoned += std::max(0, end - next);
+    while (tasks.pop(task))
+    {
+        abandoned++;
+    }
+    if (abandoned > 0)
+    {
+        completeTasks(abandoned);
+    }
+}
+
+void NodePool::drainLog(bool force)
 {
-    exit = true;
-    condition.notify_all();
+    const std::chrono::steady_clock::time_point now = 
+        std::chrono::steady_clock::now();
+    if (!force && now - last_drain < std::chrono::milliseconds(LOG_DRAIN_MS))
+    {
+        return;
+    }
+    last_drain = now;
+    std::vector<logRing*> rings;
     for (unsigned int i = 0; i < nodes.size(); i++)
     {
-#ifdef SPATIALSEIR_SINGLETHREAD
-        nodes.pop_back();
-#else
-        nodes[i].join();
-#endif
+        rings.push_back(nodes[i].log_ring.get());
+    }
+    for (unsigned int i = 0; i < remotes.size(); i++)
+    {
+        rings.push_back(&(remotes[i] -> log_ring));
+    }
+    logSeverity severity;
+    std::string msg;
+    int dropped = 0;
+    for (unsigned int i = 0; i < rings.size(); i++)
+    {
+        while (rings[i] -> pop(severity, msg))
+        {
+            Rcpp::Rcout << (severity == log_error ? "Error: " : 
+                           (severity == log_warning ? "Warning: " : ""))
+                        << msg << "\n";
+        }
+        dropped += rings[i] -> takeDropped();
+    }
+    if (dropped > 0)
+    {
+        Rcpp::Rcout << "(" << dropped << " worker messages suppressed)\n";
     }
 }
 
+bool blockFuture::ready()
+{
+    return(pool == nullptr || pool -> nPending == 0);
+}
+
+bool blockFuture::wait()
+{
+    if (pool != nullptr)
+    {
+        return(pool -> awaitFinished());
+    }
+    return(true);
+}
+
+blockFuture NodePool::submitBlock(taskKind kind, const Eigen::MatrixXd* params, 
+                                  int first, int count)
+{
+    blockFuture out;
+    if (count <= 0)
+    {
+        return(out);
+    }
+    out.pool = this;
+    cancelled = false;
+    computeLinearPredictors(params -> middleRows(first, count));
+    block_kind = kind;
+    block_params = params;
+    block_first = first;
+    nPending += count;
+    int itr, rangeStart, rangeEnd, totalWeight = 0, cumulativeWeight = 0;
+    if (nThreads > 1 && count > 1 && cost_model.ready(params -> cols()))
+    {
+        scheduleByCost(params, first, count);
+    }
+    else
+    {
+        // Each worker starts on a contiguous share of the block, in 
+        // proportion to its slot's weight. Publishing a cursor releases 
+        // the block fields to the workers.
+        block_order.clear();
+        for (itr = 0; itr < nThreads; itr++)
+        {
+            totalWeight += slotWeight(itr);
+        }
+        rangeEnd = first;
+        for (itr = 0; itr < nThreads; itr++)
+        {
+            cumulativeWeight += slotWeight(itr);
+            rangeStart = rangeEnd;
+            rangeEnd = first + (int) (((long int) count*cumulativeWeight)/totalWeight);
+            ranges[itr].cursor.store(((std::uint64_t) rangeEnd << 32) | 
+                    (std::uint32_t) rangeStart, std::memory_order_release);
+        }
+    }
+    backend -> notify(this);
+    for (itr = 0; itr < (int) remotes.size(); itr++)
+    {
+        remotes[itr] -> notify();
+    }
+    return(out);
+}
+
+void NodePool::scheduleByCost(const Eigen::MatrixXd* params, int first, 
+                              int count)
+{
+    const Eigen::VectorXd predicted = cost_model.predict(
+            params -> middleRows(first, count)).array().exp().matrix();
+    std::vector<int> byCost(count);
+    std::vector<double> finish(nThreads, 0.0);
+    std::vector<std::vector<int> > assigned(nThreads);
+    int i, itr, best, weight, pos;
+    for (i = 0; i < count; i++)
+    {
+        byCost[i] = i;
+    }
+    std::stable_sort(byCost.begin(), byCost.end(), [&predicted](int a, int b){
+            return(predicted(a) > predicted(b));});
+    for (i = 0; i < count; i++)
+    {
+        best = -1;
+        for (itr = 0; itr < nThreads; itr++)
+        {
+            weight = slotWeight(itr);
+            if (weight > 0 && (best < 0 || 
+                        finish[itr] + predicted(byCost[i])/weight < 
+                        finish[best] + predicted(byCost[i])/slotWeight(best)))
+            {
+                best = itr;
+            }
+        }
+        finish[best] += predicted(byCost[i])/slotWeight(best);
+        assigned[best].push_back(first + byCost[i]);
+    }
+    // Publishing a cursor releases block_order to the workers
+    block_order.resize(count);
+    pos = first;
+    for (itr = 0; itr < nThreads; itr++)
+    {
+        const int rangeStart = pos;
+        for (i = 0; i < (int) assigned[itr].size(); i++)
+        {
+            block_order[pos++ - first] = assigned[itr][i];
+        }
+        ranges[itr].cursor.store(((std::uint64_t) pos << 32) | 
+                (std::uint32_t) rangeStart, std::memory_order_release);
+    }
+}
+
+int NodePool::blockParticle(int pos)
+{
+    return(block_order.empty() ? pos : block_order[pos - block_first]);
+}
+
+int NodePool::slotWeight(int slot)
+{
+    return(slot < nLocal ? 1 : remotes[slot - nLocal] -> weight());
+}
+
+bool NodePool::claimChunk(int worker, std::minstd_rand& victim_generator,
+                          int& chunkStart, int& chunkSize)
+{
+    std::atomic<std::uint64_t>& own = ranges[worker].cursor;
+    std::uint64_t cursor;
+    int next, end, remaining;
+    while (true)
+    {
+        cursor = own.load(std::memory_order_acquire);
+        while (true)
+        {
+            next = (int) (cursor & 0xFFFFFFFF);
+            end = (int) (cursor >> 32);
+            remaining = end - next;
+            if (remaining <= 0)
+            {
+                break;
+            }
+            // A lone worker has no contention to amortize, and single 
+            // tasks let awaitTask stop right after its particle.
+            chunkSize = (nThreads == 1 ? 1 : std::max(1, remaining/(2*nThreads)));
+            if (own.compare_exchange_weak(cursor, 
+                    ((std::uint64_t) end << 32) | (std::uint32_t) (next + chunkSize),
+                    std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                chunkStart = next;
+                return(true);
+            }
+        }
+        chunkSize = 0;
+        if (!stealRange(worker, victim_generator, cursor, chunkStart, chunkSize))
+        {
+            return(false);
+        }
+        if (chunkSize > 0)
+        {
+            return(true);
+        }
+    }
+}
+
+bool NodePool::stealRange(int worker, std::minstd_rand& victim_generator,
+                          std::uint64_t emptyCursor, int& chunkStart, 
+                          int& chunkSize)
+{
+    const int first_victim = (int) (victim_generator() % nThreads);
+    std::uint64_t cursor;
+    int itr, victim, next, end, remaining, stolen;
+    for (itr = 0; itr < nThreads; itr++)
+    {
+        victim = (first_victim + itr) % nThreads;
+        if (victim == worker)
+        {
+            continue;
+        }
+        std::atomic<std::uint64_t>& target = ranges[victim].cursor;
+        cursor = target.load(std::memory_order_acquire);
+        while (true)
+        {
+            next = (int) (cursor & 0xFFFFFFFF);
+            end = (int) (cursor >> 32);
+            remaining = end - next;
+            if (remaining <= 0)
+            {
+                break;
+            }
+            stolen = (remaining + 1)/2;
+            if (target.compare_exchange_weak(cursor, 
+                    ((std::uint64_t) (end - stolen) << 32) | (std::uint32_t) next,
+                    std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                // The own range can only have changed if a new block was
+                // published meanwhile; run the stolen tasks directly then.
+                if (!ranges[worker].cursor.compare_exchange_strong(emptyCursor,
+                        ((std::uint64_t) end << 32) | (std::uint32_t) (end - stolen),
+                        std::memory_order_acq_rel))
+                {
+                    chunkStart = end - stolen;
+                    chunkSize = stolen;
+                }
+                return(true);
+            }
+        }
+    }
+    return(false);
+}
+
+bool NodePool::parallelFor(int count, const std::function<void(int)>& body)
+{
+    if (count <= 0)
+    {
+        return(true);
+    }
+    cancelled = false;
+    kernel = &body;
+    nPending += count;
+    // Publishing the range releases kernel to the workers
+    kernel_range.cursor.store((std::uint64_t) count << 32, 
+                              std::memory_order_release);
+    backend -> notify(this);
+    return(awaitFinished());
+}
+
+bool NodePool::claimKernel(int& chunkStart, int& chunkSize)
+{
+    std::uint64_t cursor = kernel_range.cursor.load(std::memory_order_acquire);
+    int next, end;
+    while (true)
+    {
+        next = (int) (cursor & 0xFFFFFFFF);
+        end = (int) (cursor >> 32);
+        if (next >= end)
+        {
+            return(false);
+        }
+        chunkSize = std::max(1, (end - next)/(2*nLocal));
+        if (kernel_range.cursor.compare_exchange_weak(cursor, 
+                ((std::uint64_t) end << 32) | (std::uint32_t) (next + chunkSize),
+                std::memory_order_acq_rel, std::memory_order_acquire))
+        {
+            chunkStart = next;
+            return(true);
+        }
+    }
+}
+
+bool NodePool::hasWork()
+{
+    const std::uint64_t cursor = kernel_range.cursor.load(std::memory_order_acquire);
+    return(!tasks.empty() || (cursor & 0xFFFFFFFF) < (cursor >> 32) || 
+           blockAvailable());
+}
+
+bool NodePool::blockAvailable()
+{
+    std::uint64_t cursor;
+    for (int itr = 0; itr < nThreads; itr++)
+    {
+        cursor = ranges[itr].cursor.load(std::memory_order_acquire);
+        if ((cursor & 0xFFFFFFFF) < (cursor >> 32))
+        {
+            return(true);
+        }
+    }
+    return(false);
+}
+
+instruction NodePool::blockTask(int idx)
+{
+    const bool has_reinfection = ((data -> reinfection_precision)(0) > 0);
+    instruction inst;
+    inst.kind = block_kind;
+    inst.param_idx = idx;
+    inst.params = block_params;
+    inst.eta = eta_block.col(idx - block_first).data();
+    inst.p_rs = (has_reinfection ? p_rs_block.col(idx - block_first).data() 
+                                 : nullptr);
+    return(inst);
+}
+
+void NodePool::completeTasks(int n)
+{
+    if ((nPending -= n) == 0)
+    {
+        // A waiter which is still spinning will see nPending without a
+        // wakeup
+        wakeParked();
+    }
+}
+
+int NodePool::linearPredictorBlockSize()
+{
+    const bool has_reinfection = ((data -> reinfection_precision)(0) > 0);
+    const long int particleBytes = sizeof(double)*((data -> X).rows() + 
+            (has_reinfection ? (data -> X_rs).rows() : 0));
+    return((int) std::max(1L, LINEAR_PREDICTOR_BLOCK_BYTES/particleBytes));
+}
+
+void NodePool::computeLinearPredictors(const Eigen::MatrixXd& params)
+{
+    const bool has_reinfection = ((data -> reinfection_precision)(0) > 0);
+    const int nBeta = (data -> X).cols();
+    const int nReinf = (has_reinfection ? (data -> X_rs).cols() : 0);
+
+    // One GEMM per block streams X once, rather than once per particle
+    eta_block.noalias() = (data -> X)*(params.leftCols(nBeta).transpose());
+    eta_block = eta_block.unaryExpr([](double e){return(std::exp(e));});
+    if (has_reinfection)
+    {
+        const double offset_0 = (data -> offset)(0);
+        p_rs_block.noalias() = (data -> X_rs)*(params.middleCols(nBeta, 
+                    nReinf).transpose());
+        p_rs_block = p_rs_block.unaryExpr([offset_0](double e){
+                return(1-std::exp(-std::exp(e)*offset_0));});
+    }
+    else
+    {
+        p_rs_block.resize(0, 0);
+    }
+}
+
+NodePool::~NodePool()
+{
+    // Abandoned tasks stop early, so the backend's threads and remote 
+    // workers leave promptly
+    cancel();
+    remotes.clear();
+    backend -> detach(this);
+}
+
 
 SEIR_sim_node::SEIR_sim_node(NodeWorker* worker,
                              int sd,
-                             Eigen::VectorXi s,
-                             Eigen::VectorXi e,
-                             Eigen::VectorXi i,
-                             Eigen::VectorXi r,
-                             Eigen::VectorXd offs,
-                             Eigen::MatrixXi y,
-                             MatrixXb nm,
-                             int dmt,
-                             std::vector<Eigen::MatrixXd> dmv,
-                             std::vector<std::vector<Eigen::MatrixXd> > tdmv,
-                             std::vector<int> tdme,
-                             Eigen::MatrixXd x,
-                             Eigen::MatrixXd x_rs,
-                             std::string mode,
-                             Eigen::MatrixXd ei_prior,
-                             Eigen::MatrixXd ir_prior,
-                             double avgI,
-                             Eigen::VectorXd sp_prior,
-                             Eigen::VectorXd se_prec,
-                             Eigen::VectorXd rs_prec,
-                             Eigen::VectorXd se_mean,
-                             Eigen::VectorXd rs_mean,
-                             double ph,
-                             int dmc,
-                             bool cmltv,
-                             int m_
+                             std::shared_ptr<const simulationModelData> dat,
+                             std::shared_ptr<captureSpecification> cspec,
+                             const std::atomic<bool>* cncl
                              ) : parent(worker),
                                  random_seed(sd),
-                                 S0(s),
-                                 E0(e),
-                                 I0(i),
-                                 R0(r),
-                                 offset(offs),
-                                 Y(y),
-                                 na_mask(nm),
-                                 dataModelType(dmt),
-                                 DM_vec(dmv),
-                                 TDM_vec(tdmv),
-                                 TDM_empty(tdme),
-                                 X(x),
-                                 X_rs(x_rs),
-                                 transitionMode(mode),
-                                 E_to_I_prior(ei_prior),
-                                 I_to_R_prior(ir_prior),
-                                 inf_mean(avgI),
-                                 spatial_prior(sp_prior),
-                                 exposure_precision(se_prec),
-                                 reinfection_precision(rs_prec),
-                                 exposure_mean(se_mean),
-                                 reinfection_mean(rs_mean),
-                                 phi(ph),
-                                 data_compartment(dmc),
-                                 cumulative(cmltv),
-                                 m(m_)
+                                 data(dat),
+                                 S0(dat -> S0),
+                                 E0(dat -> E0),
+                                 I0(dat -> I0),
+                                 R0(dat -> R0),
+                                 offset(dat -> offset),
+                                 Y(dat -> Y),
+                                 na_mask(dat -> na_mask),
+                                 dataModelType(dat -> dataModelType),
+                                 DM_vec(dat -> DM_vec),
+                                 TDM_vec(dat -> TDM_vec),
+                                 TDM_empty(dat -> TDM_empty),
+                                 X(dat -> X),
+                                 X_rs(dat -> X_rs),
+                                 transitionMode(dat -> transitionMode),
+                                 E_to_I_prior(dat -> E_to_I_prior),
+                                 I_to_R_prior(dat -> I_to_R_prior),
+                                 inf_mean(dat -> inf_mean),
+                                 spatial_prior(dat -> spatial_prior),
+                                 exposure_precision(dat -> exposure_precision),
+                                 reinfection_precision(dat -> reinfection_precision),
+                                 exposure_mean(dat -> exposure_mean),
+                                 reinfection_mean(dat -> reinfection_mean),
+                                 phi(dat -> phi),
+                                 data_compartment(dat -> data_compartment),
+                                 cumulative(dat -> cumulative),
+                                 m(dat -> m),
+                                 capture_replicates(dat -> capture_replicates),
+                                 compress_compartments(dat -> compress_compartments),
+                                 capture(cspec),
+                                 cancel_token(cncl)
 {
     try
     {
@@ -424,6 +1087,17 @@ SEIR_sim_node::SEIR_sim_node(NodeWorker* worker,
         E_paths = std::vector<Eigen::MatrixXi>();
         I_paths = std::vector<Eigen::MatrixXi>();
 
+        full_capture.active = true;
+        full_capture.compartments = {0, 1, 2, 3, 4, 5, 6, 7};
+        full_capture.location_map = std::vector<int>(Y.cols());
+        for (i = 0; i < Y.cols(); i++)
+        {
+            full_capture.location_map[i] = i;
+        }
+        full_capture.nColumns = Y.cols();
+        full_capture.time_start = 0;
+        full_capture.time_end = Y.rows();
+
         if (transitionMode == "weibull")
         {
             EI_transition_dist = std::unique_ptr<weibullTransitionDistribution>(
@@ -473,9 +1147,103 @@ SEIR_sim_node::SEIR_sim_node(NodeWorker* worker,
     const int nTrans = (transitionMode == "exponential" ? 2 : 
                        (transitionMode == "weibull" ? 4 : 0));
     total_size = nRho + nReinf + nBeta + nTrans;
+
+    population = (S0 + E0 + I0 + R0).cast<double>();
+    foi_cache = Eigen::VectorXd::Zero(S0.size());
+    exposure_rate = Eigen::VectorXd::Zero(S0.size());
+    active_locations.reserve(S0.size());
+    reachable_locations.reserve(S0.size());
+}
+
+void SEIR_sim_node::gatherInfectious(const Eigen::VectorXi& infectious,
+                                     const Eigen::Map<const Eigen::MatrixXd>& components,
+                                     int time_idx)
+{
+    int i;
+    double val;
+    active_locations.clear();
+    foi_cache.setZero();
+    for (i = 0; i < infectious.size(); i++)
+    {
+        if (infectious(i) > 0)
+        {
+            val = infectious(i)/population(i)*components(time_idx, i);
+            // Protect against overflow in components
+            foi_cache(i) = (val == val ? val : 0);
+            active_locations.push_back(i);
+        }
+    }
+}
+
+void SEIR_sim_node::addContactProduct(const Eigen::MatrixXd& contact, 
+                                      double weight,
+                                      Eigen::VectorXd& rate)
+{
+    // Column-wise accumulation touches nActive*nLoc entries rather than
+    // nLoc^2, but loses to the blocked GEMV once most locations are active.
+    if ((int) active_locations.size()*SPARSE_CONTACT_RATIO < contact.cols())
+    {
+        for (unsigned int j = 0; j < active_locations.size(); j++)
+        {
+            rate.noalias() += (weight*foi_cache(active_locations[j]))
+                *contact.col(active_locations[j]);
+        }
+    }
+    else
+    {
+        rate.noalias() += weight*(contact*foi_cache);
+    }
 }
 
-simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCompartments)
+void SEIR_sim_node::calculateExposureProbability(const Eigen::VectorXi& infectious,
+                                       compartment_tap* lagged_infectious,
+                                       const Eigen::Map<const Eigen::MatrixXd>& components,
+                                       const Eigen::VectorXd& rho,
+                                       int time_idx,
+                                       Eigen::VectorXd& p_se)
+{
+    unsigned int idx;
+    int i, lag;
+    gatherInfectious(infectious, components, time_idx);
+    exposure_rate = foi_cache;
+    if (has_spatial && active_locations.size() > 0)
+    {
+        for (idx = 0; idx < DM_vec.size(); idx++)
+        {
+            addContactProduct(DM_vec[idx], rho[idx], exposure_rate);
+        }
+    }
+    if (lagged_infectious != nullptr)
+    {
+        for (lag = 0; time_idx - lag - 1 >= 0 && lag < (int) TDM_vec[0].size(); lag++)
+        {
+            gatherInfectious(lagged_infectious -> get(lag), components, 
+                             time_idx - lag - 1);
+            if (active_locations.size() > 0)
+            {
+                addContactProduct(TDM_vec[time_idx - lag - 1][lag], 
+                                  rho[DM_vec.size() + lag], 
+                                  exposure_rate);
+            }
+        }
+    }
+
+    reachable_locations.clear();
+    p_se.setZero();
+    for (i = 0; i < exposure_rate.size(); i++)
+    {
+        if (exposure_rate(i) > 0)
+        {
+            p_se(i) = 1 - std::exp(-1.0*exposure_rate(i)*offset(time_idx));
+            reachable_locations.push_back(i);
+        }
+    }
+}
+
+simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, 
+                                            bool keepCompartments,
+                                            const double* eta_values,
+                                            const double* p_rs_values)
 {
     // Params is a vector made of:
     // [Beta, Beta_RS, rho, gamma_ei, gamma_ir]    
@@ -492,6 +1260,15 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
     double report_fraction;
     
     simulationResultSet compartmentResults;
+    // Replicates w < nCaptured are recorded; replicate w occupies columns
+    // [w*nLoc, (w+1)*nLoc) of each compartment matrix, which matches the 
+    // memory layout of an R array with dim c(nTpt, nLoc, nCaptured).
+    const int nCaptured = (capture_replicates ? m : 1);
+    const captureSpecification& spec = (capture -> active ? *capture : 
+                                        full_capture);
+    // Exposure probabilities are only kept for complete, uncompressed output
+    const bool keep_p_se = (keepCompartments && !compress_compartments && 
+                            !(capture -> active));
  
     Eigen::VectorXd results = Eigen::VectorXd::Zero(m); 
 
@@ -576,11 +1353,6 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
         }
     }
 
-    Eigen::VectorXi N(S0.size());
-    N = (S0 + E0 + I0 + R0);
-
-    Eigen::MatrixXd p_se_cache(S0.size(), m);
-
     Eigen::MatrixXi current_S(S0.size(), m);
     Eigen::MatrixXi current_E(S0.size(), m);
     Eigen::MatrixXi current_I(S0.size(), m);
@@ -604,6 +1376,10 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
 
     Eigen::MatrixXi cumulative_compartment(S0.size(), m);
 
+    const Eigen::MatrixXi* compartment_sources[8] = {
+        &previous_S, &previous_E, &previous_I, &previous_R,
+        &previous_S_star, &previous_E_star, &previous_I_star, &previous_R_star};
+
     Eigen::MatrixXi* comparison_compartment = (data_compartment == 0 ?
                                                &previous_I_star : 
                                               (data_compartment == 1 ? 
@@ -615,12 +1391,18 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
     // p_se calculation
     // Equivalent R expression: 
     // exp(matrix(X %*% beta, nrow = nrow(Y), ncol = ncol(Y)))
-    Eigen::MatrixXd eta = (X*beta).unaryExpr([](double elem){return(
-                std::exp(elem));
-            });
+    // The pool may have evaluated this for a block of particles already.
+    Eigen::MatrixXd eta;
+    if (eta_values == nullptr)
+    {
+        eta = (X*beta).unaryExpr([](double elem){return(
+                    std::exp(elem));
+                });
+        eta_values = eta.data();
+    }
     //printDMatrix(eta, "eta");
 
-    Eigen::Map<Eigen::MatrixXd, Eigen::ColMajor> p_se_components(eta.data(), 
+    Eigen::Map<const Eigen::MatrixXd> p_se_components(eta_values, 
                 Y.rows(), Y.cols());
 
     //printDMatrix(p_se_components, "p_se_components");
@@ -655,25 +1437,7 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
         }
     }
 
-    p_se_cache = (((previous_I.cast<double>().array().colwise())
-        /N.cast<double>().array()).array().colwise()*
-        p_se_components.row(0).transpose().array()).unaryExpr([](double e){
-            // Protect against overflow in components
-            return(e == e ? e : 0);
-        });
-
-    Eigen::MatrixXd p_se = 1*p_se_cache; 
-
-    if (has_spatial)
-    {
-        for (idx = 0; idx < DM_vec.size(); idx++)
-        {
-            p_se += rho[idx]*(DM_vec[idx] * (p_se_cache));
-        }
-    }
-    p_se = (((-1.0*p_se.array()) * (offset(0)))).unaryExpr([](double e){
-            return(1-std::exp(e));
-            }); 
+    Eigen::VectorXd p_se = Eigen::VectorXd::Zero(S0.size());
 
     // Not used if transitionMode != "exponential"
     Eigen::VectorXd p_ei = (-1.0*gamma_ei*offset)
@@ -683,7 +1447,11 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
                             .unaryExpr([](double e){return(1-std::exp(e));}); 
 
     Eigen::VectorXd p_rs;
-    if (has_reinfection)
+    if (has_reinfection && p_rs_values != nullptr)
+    {
+        p_rs = Eigen::Map<const Eigen::VectorXd>(p_rs_values, Y.rows());
+    }
+    else if (has_reinfection)
     {
         p_rs = ((((X_rs*beta_rs).unaryExpr([](double e){return(std::exp(e));})).array() 
                     * offset(0)).matrix()).unaryExpr([](double e){return(1-std::exp(-e));});
@@ -701,23 +1469,35 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
         {
             compartmentResults.result(i) = 0.0;
         }
-        compartmentResults.S = Eigen::MatrixXi(Y.rows(), Y.cols());
-        compartmentResults.E = Eigen::MatrixXi(Y.rows(), Y.cols());
-        compartmentResults.I = Eigen::MatrixXi(Y.rows(), Y.cols());
-        compartmentResults.R = Eigen::MatrixXi(Y.rows(), Y.cols());
-
-        compartmentResults.S_star = Eigen::MatrixXi(Y.rows(), Y.cols());
-        compartmentResults.E_star = Eigen::MatrixXi(Y.rows(), Y.cols());
-        compartmentResults.I_star = Eigen::MatrixXi(Y.rows(), Y.cols());
-        compartmentResults.R_star = Eigen::MatrixXi(Y.rows(), Y.cols());
+        // S, E, I and R follow from the transition counts, so are not 
+        // stored when compressing.
+        recorded_compartments.clear();
+        for (idx = 0; idx < spec.compartments.size(); idx++)
+        {
+            if (!compress_compartments || spec.compartments[idx] >= 4)
+            {
+                recorded_compartments.push_back(spec.compartments[idx]);
+            }
+        }
+        Eigen::MatrixXi* destinations[8] = {
+            &compartmentResults.S, &compartmentResults.E,
+            &compartmentResults.I, &compartmentResults.R,
+            &compartmentResults.S_star, &compartmentResults.E_star, 
+            &compartmentResults.I_star, &compartmentResults.R_star};
+        for (idx = 0; idx < recorded_compartments.size(); idx++)
+        {
+            *destinations[recorded_compartments[idx]] = Eigen::MatrixXi::Zero(
+                    spec.time_end - spec.time_start, spec.nColumns*nCaptured);
+        }
+        if (keep_p_se)
+        {
+            compartmentResults.p_se = Eigen::MatrixXd(Y.rows(), Y.cols()*nCaptured);
+            compartmentResults.X = X; 
+        }
         
-        compartmentResults.X = Eigen::MatrixXd(X.rows(), X.cols());  
-        compartmentResults.X = X; 
         compartmentResults.beta = Eigen::MatrixXd(1, beta.size());
         compartmentResults.beta = beta.transpose(); 
 
-        compartmentResults.p_se = Eigen::MatrixXd(Y.rows(), Y.cols());
-        compartmentResults.p_se.row(0) = p_se.col(0);
         if (transitionMode == "exponential")
         {
             compartmentResults.p_ei = p_ei.transpose(); 
@@ -745,19 +1525,38 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
     int tmpDraw, w;
     for (w = 0; w < m; w++)
     {
+        calculateExposureProbability(previous_I.col(w), nullptr, 
+                                     p_se_components, rho, 0, p_se);
+        if (keep_p_se && w < nCaptured)
+        {
+            compartmentResults.p_se.block(0, w*S0.size(), 1, S0.size()) = p_se.transpose();
+        }
+        // Only reachable locations can have new exposures
+        previous_E_star.col(w).setZero();
+        for (idx = 0; idx < reachable_locations.size(); idx++)
+        {
+            i = reachable_locations[idx];
+            if (previous_S(i, w) > 0)
+            {
+                previous_E_star(i, w) = std::binomial_distribution<int>(
+                        previous_S(i, w), p_se(i))(*generator);
+            }
+        }
+
         for (i = 0; i < Y.cols(); i++)
         {
-            previous_S_star(i, w) = std::binomial_distribution<int>(
-                    previous_R(i, w), p_rs(0))(*generator);
-            previous_E_star(i, w) = std::binomial_distribution<int>(
-                    previous_S(i, w), p_se(i, w))(*generator);
+            previous_S_star(i, w) = (previous_R(i, w) > 0 ? 
+                std::binomial_distribution<int>(
+                    previous_R(i, w), p_rs(0))(*generator) : 0);
 
             if (transitionMode == "exponential")
             {
-                previous_I_star(i, w) = std::binomial_distribution<int>(
-                        previous_E(i, w), p_ei(0))(*generator);
-                previous_R_star(i, w) = std::binomial_distribution<int>(
-                        previous_I(i, w), p_ir(0))(*generator);
+                previous_I_star(i, w) = (previous_E(i, w) > 0 ? 
+                    std::binomial_distribution<int>(
+                        previous_E(i, w), p_ei(0))(*generator) : 0);
+                previous_R_star(i, w) = (previous_I(i, w) > 0 ? 
+                    std::binomial_distribution<int>(
+                        previous_I(i, w), p_ir(0))(*generator) : 0);
             }
             else if (transitionMode == "path_specific")
             {
@@ -881,17 +1680,10 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
 
     if (keepCompartments)
     {
-        for (i = 0; i < S0.size(); i++)
+        for (w = 0; w < nCaptured; w++)
         {
-            compartmentResults.S(time_idx, i) = S0(i);
-            compartmentResults.E(time_idx, i) = E0(i);
-            compartmentResults.I(time_idx, i) = I0(i);
-            compartmentResults.R(time_idx, i) = R0(i);
-
-            compartmentResults.S_star(time_idx, i) = previous_S_star(i,0);
-            compartmentResults.E_star(time_idx, i) = previous_E_star(i,0);
-            compartmentResults.I_star(time_idx, i) = previous_I_star(i,0);
-            compartmentResults.R_star(time_idx, i) = previous_R_star(i,0);
+            recordCompartments(compartmentResults, spec, compartment_sources,
+                               time_idx, w);
         }
     }
 
@@ -916,57 +1708,43 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
 
     // Simulation: iterative case
     //printDMatrix(p_se_components, "p_se_components");
-    int lag;
     for (w = 0; w < m; w++)
     {
         for (time_idx = 1; time_idx < Y.rows(); time_idx++)
         {
-            p_se_cache = ((previous_I.cast<double>().array().col(w)).array()
-                /N.cast<double>().array()*
-                p_se_components.row(time_idx).transpose().array()
-                ).unaryExpr([](double e){
-                    // Protect against overflow in components
-                    return(e == e ? e : 0);
-                });
-
-            p_se = 1*p_se_cache; 
-            if (has_spatial)
+            if (time_idx % CANCEL_CHECK_INTERVAL == 0 && 
+                    cancel_token -> load(std::memory_order_relaxed))
             {
-                for (idx = 0; idx < DM_vec.size(); idx++)
-                {
-                    p_se += rho[idx]*(DM_vec[idx] * p_se_cache);
-                }
+                // The pool discards the results of cancelled simulations
+                compartmentResults.result = Eigen::VectorXd::Constant(m, 
+                        std::numeric_limits<double>::infinity());
+                return(compartmentResults);
             }
+            calculateExposureProbability(previous_I.col(w), 
+                    (has_ts_spatial && !TDM_empty[time_idx] ? &I_lag[w] : nullptr),
+                    p_se_components, rho, time_idx, p_se);
 
-            if (has_ts_spatial && !TDM_empty[time_idx])
-            {   
-                for (lag = 0; time_idx - lag - 1 >= 0 && lag < (int) TDM_vec[0].size(); lag++)
+            previous_E_star.col(w).setZero();
+            for (idx = 0; idx < reachable_locations.size(); idx++)
+            {
+                i = reachable_locations[idx];
+                if (previous_S(i,w) > 0)
                 {
-                    p_se_cache = ((I_lag[w].get(lag).cast<double>()).array()
-                        /N.cast<double>().array()*
-                        p_se_components.row(time_idx - lag - 1).transpose().array()
-                        ).unaryExpr([](double e){
-                            // Protect against overflow in components
-                            return(e == e ? e : 0);}
-                        );
-                    p_se += rho[DM_vec.size() + lag]*(TDM_vec[time_idx-lag - 1][lag] * p_se_cache);
+                    previous_E_star(i,w) = std::binomial_distribution<int>(previous_S(i,w), p_se(i))(*generator);
                 }
             }
-
-
-            //Rcpp::Rcout << "offset(" << time_idx << "): " << offset(time_idx) << "\n";
-            p_se = ((-1.0*p_se.array() * offset(time_idx)).matrix()
-                    ).unaryExpr([](double e){return(1-std::exp(e));});
      
             for (i = 0; i < Y.cols(); i++)
             {
-                previous_S_star(i,w) = std::binomial_distribution<int>(previous_R(i,w), p_rs(time_idx))(*generator);
-                previous_E_star(i,w) = std::binomial_distribution<int>(previous_S(i,w), p_se(i,0))(*generator);
+                previous_S_star(i,w) = (previous_R(i,w) > 0 ? 
+                    std::binomial_distribution<int>(previous_R(i,w), p_rs(time_idx))(*generator) : 0);
 
                 if (transitionMode == "exponential")
                 {
-                    previous_I_star(i,w) = std::binomial_distribution<int>(previous_E(i,w), p_ei(time_idx))(*generator);
-                    previous_R_star(i,w) = std::binomial_distribution<int>(previous_I(i,w), p_ir(time_idx))(*generator);
+                    previous_I_star(i,w) = (previous_E(i,w) > 0 ? 
+                        std::binomial_distribution<int>(previous_E(i,w), p_ei(time_idx))(*generator) : 0);
+                    previous_R_star(i,w) = (previous_I(i,w) > 0 ? 
+                        std::binomial_distribution<int>(previous_I(i,w), p_ir(time_idx))(*generator) : 0);
                 }
                 else if (transitionMode == "path_specific")
                 {
@@ -1104,21 +1882,15 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
                 }
             }
 
-            if (keepCompartments)
+            // Each replicate writes its own block: replicates other than 
+            // the first must not overwrite the first replicate's trajectory.
+            if (keepCompartments && w < nCaptured)
             {
-                for (i = 0; i < S0.size(); i++)
+                recordCompartments(compartmentResults, spec, 
+                                   compartment_sources, time_idx, w);
+                if (keep_p_se)
                 {
-                    compartmentResults.S(time_idx, i) = previous_S(i,0);
-                    compartmentResults.E(time_idx, i) = previous_E(i,0);
-                    compartmentResults.I(time_idx, i) = previous_I(i,0);
-                    compartmentResults.R(time_idx, i) = previous_R(i,0);
-
-                    compartmentResults.S_star(time_idx, i) = previous_S_star(i,0);
-                    compartmentResults.E_star(time_idx, i) = previous_E_star(i,0);
-                    compartmentResults.I_star(time_idx, i) = previous_I_star(i,0);
-                    compartmentResults.R_star(time_idx, i) = previous_R_star(i,0);
-
-                    compartmentResults.p_se.row(time_idx) = p_se.col(0);
+                    compartmentResults.p_se.block(time_idx, w*S0.size(), 1, S0.size()) = p_se.transpose();
                 }
             }
 
@@ -1146,12 +1918,56 @@ simulationResultSet SEIR_sim_node::simulate(Eigen::VectorXd params, bool keepCom
     }
 
     compartmentResults.result = results;
+    if (keepCompartments && compress_compartments)
+    {
+        // Compartments outside the capture specification are empty, and 
+        // encode to empty byte vectors.
+        encodeTransitionCounts(compartmentResults.S_star, compartmentResults.S_star_code);
+        encodeTransitionCounts(compartmentResults.E_star, compartmentResults.E_star_code);
+        encodeTransitionCounts(compartmentResults.I_star, compartmentResults.I_star_code);
+        encodeTransitionCounts(compartmentResults.R_star, compartmentResults.R_star_code);
+        compartmentResults.S_star.resize(0, 0);
+        compartmentResults.E_star.resize(0, 0);
+        compartmentResults.I_star.resize(0, 0);
+        compartmentResults.R_star.resize(0, 0);
+    }
     return(compartmentResults);
 }
 
-void SEIR_sim_node::nodeMessage(std::string msg)
+void SEIR_sim_node::recordCompartments(simulationResultSet& results,
+                                       const captureSpecification& spec,
+                                       const Eigen::MatrixXi* const* sources,
+                                       int time_idx,
+                                       int w)
+{
+    if (time_idx < spec.time_start || time_idx >= spec.time_end)
+    {
+        return;
+    }
+    Eigen::MatrixXi* destinations[8] = {
+        &results.S, &results.E, &results.I, &results.R,
+        &results.S_star, &results.E_star, &results.I_star, &results.R_star};
+    const int t = time_idx - spec.time_start;
+    const int col_offset = w*spec.nColumns;
+    unsigned int c;
+    int i;
+    for (c = 0; c < recorded_compartments.size(); c++)
+    {
+        Eigen::MatrixXi& destination = *destinations[recorded_compartments[c]];
+        const Eigen::MatrixXi& source = *sources[recorded_compartments[c]];
+        for (i = 0; i < source.rows(); i++)
+        {
+            if (spec.location_map[i] >= 0)
+            {
+                destination(t, col_offset + spec.location_map[i]) += source(i, w);
+            }
+        }
+    }
+}
+
+void SEIR_sim_node::nodeMessage(logSeverity severity, const std::string& msg)
 {
-    messages.push_back(msg);
+    parent -> addMessage(severity, msg);
 }
 
 SEIR_sim_node::~SEIR_sim_node()
@@ -0,0 +1,189 @@
+#include <Rcpp.h>
+#include <stdexcept>
+#include <executionBackend.hpp>
+#include <SEIRSimNodes.hpp>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/** Runs every task on the R thread, one at a time, in dispatch order, so
+ * that results with a given seed are reproducible*/
+class serialBackend : public executionBackend
+{
+    public:
+        int localSlots(int threads)
+        {
+            return(1);
+        }
+
+        bool runsOnCaller()
+        {
+            return(true);
+        }
+
+        void attach(NodePool* pool, bool pin) {}
+        void detach(NodePool* pool) {}
+
+        void notify(NodePool* pool)
+        {
+            pool -> wakeParked();
+        }
+
+        void await(NodePool* pool, int param_idx)
+        {
+            while (!(pool -> waitSatisfied(param_idx)))
+            {
+                // The simulations run on the R thread here, so poll for
+                // interrupts between tasks.
+                if ((pool -> nodes)[0].runNext())
+                {
+                    pool -> pollInterrupt();
+                }
+                else
+                {
+                    // What remains is running on remote workers
+                    pool -> park(param_idx, true);
+                }
+            }
+        }
+};
+
+/** Runs tasks on the process wide sharedThreadPool, so that they proceed
+ * while the R thread prepares the next batch*/
+class threadBackend : public executionBackend
+{
+    public:
+        int localSlots(int threads)
+        {
+            return(threads);
+        }
+
+        bool runsOnCaller()
+        {
+            return(false);
+        }
+
+        void attach(NodePool* pool, bool pin)
+        {
+            sharedThreadPool::instance().attach(pool, pool -> nLocal, pin);
+        }
+
+        void detach(NodePool* pool)
+        {
+            sharedThreadPool::instance().detach(pool);
+        }
+
+        void notify(NodePool* pool)
+        {
+            sharedThreadPool::instance().notify();
+        }
+
+        void await(NodePool* pool, int param_idx)
+        {
+            if (!spinWait([pool, param_idx](){ 
+                        return(pool -> waitSatisfied(param_idx)); }, 
+                        pool -> spin_us))
+            {
+                pool -> park(param_idx, false);
+            }
+        }
+};
+
+#ifdef _OPENMP
+/** Runs tasks in an OpenMP parallel region entered while the R thread
+ * waits, with the R thread serving slot 0. Nothing runs between waits,
+ * but no threads are kept besides those of the OpenMP runtime. A region
+ * runs the whole published block, rather than stopping at the awaited 
+ * task, so that a streaming sampler awaiting each particle in turn enters
+ * one region per block; awaits of finished tasks return at once.*/
+class openmpBackend : public executionBackend
+{
+    public:
+        int localSlots(int threads)
+        {
+            return(threads);
+        }
+
+        bool runsOnCaller()
+        {
+            return(true);
+        }
+
+        void attach(NodePool* pool, bool pin) {}
+        void detach(NodePool* pool) {}
+
+        void notify(NodePool* pool)
+        {
+            pool -> wakeParked();
+        }
+
+        void await(NodePool* pool, int param_idx)
+        {
+            if (pool -> waitSatisfied(param_idx))
+            {
+                return;
+            }
+            std::atomic<bool> stop(false);
+            #pragma omp parallel num_threads(pool -> nLocal)
+            {
+                const int worker = omp_get_thread_num();
+                if (worker == 0)
+                {
+                    // The master thread is the R thread, so it alone polls
+                    // for interrupts, and decides when the region ends.
+                    while (!(pool -> waitSatisfied(-1)))
+                    {
+                        if ((pool -> nodes)[0].runNext())
+                        {
+                            pool -> pollInterrupt();
+                        }
+                        else
+                        {
+                            pool -> park(-1, true);
+                        }
+                    }
+                    stop = true;
+                }
+                else
+                {
+                    while (!stop && (pool -> nodes)[worker].runNext())
+                    {
+                        // pass
+                    }
+                }
+            }
+        }
+};
+#endif
+
+std::unique_ptr<executionBackend> executionBackend::create(backendKind kind)
+{
+    if (kind == backend_serial)
+    {
+        return(std::unique_ptr<executionBackend>(new serialBackend()));
+    }
+    else if (kind == backend_threads)
+    {
+        return(std::unique_ptr<executionBackend>(new threadBackend()));
+    }
+#ifdef _OPENMP
+    else if (kind == backend_openmp)
+    {
+        return(std::unique_ptr<executionBackend>(new openmpBackend()));
+    }
+#endif
+    throw std::runtime_error("execution backend not available in this build");
+}
+
+bool executionBackend::available(backendKind kind)
+{
+    if (kind == backend_openmp)
+    {
+#ifdef _OPENMP
+        return(true);
+#else
+        return(false);
+#endif
+    }
+    return(kind == backend_serial || kind == backend_threads);
+}
@@ -14,7 +14,39 @@
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <chrono>
 #include <memory>
+#include <cstdint>
+#include <functional>
+#include <taskQueue.hpp>
+#include <logRing.hpp>
+#include <executionBackend.hpp>
+#include <taskCostModel.hpp>
+#include <workerPlacement.hpp>
+
+// Contact products switch from active-column accumulation to a dense 
+// GEMV once more than 1/SPARSE_CONTACT_RATIO of locations are infectious.
+#define SPARSE_CONTACT_RATIO 2
+
+// Upper bound on the memory, in bytes, used to hold the linear predictors
+// of a block of particles evaluated together by NodePool.
+#define LINEAR_PREDICTOR_BLOCK_BYTES (64*1024*1024)
+
+// Simulations check for cancellation once every CANCEL_CHECK_INTERVAL time
+// points, and awaitFinished polls for R interrupts every 
+// INTERRUPT_POLL_MS milliseconds. Worker logs are printed at most every
+// LOG_DRAIN_MS milliseconds while waiting, and whenever a block finishes.
+#define CANCEL_CHECK_INTERVAL 8
+#define INTERRUPT_POLL_MS 100
+#define LOG_DRAIN_MS 100
+
+// An idle worker's adaptive spin budget never falls below 
+// 1/SPIN_BUDGET_RANGE of the configured spin_wait_us.
+#define SPIN_BUDGET_RANGE 8
+
+// Number of task descriptors the NodePool queue can hold at once. Producers
+// wait for workers to drain the queue when it is full.
+#define TASK_QUEUE_CAPACITY 1024
 
 using namespace std;
 
@@ -28,79 +60,155 @@ using exit_atom = "exit";
 
 struct simulationResultSet;
 class transitionDistribution;
+class compartment_tap;
 class NodePool;
 class NodeWorker;
+class remoteProxy;
+
+/** Check for a user interrupt without longjmp-ing out of C++ code. The 
+ * interrupt is consumed, so callers must signal it to R themselves. Must
+ * be called from the R thread.*/
+bool pendingInterrupt();
+
+/** Projection of the simulated compartments which is retained for each
+ * particle when compartments are kept. Compartments are indexed in the 
+ * order S, E, I, R, S_star, E_star, I_star, R_star. Location i is written 
+ * to output column location_map[i], or dropped if location_map[i] < 0; 
+ * locations sharing a column are summed. Only time points in 
+ * [time_start, time_end) are stored. When inactive, every compartment is
+ * kept at every location and time point.*/
+struct captureSpecification
+{
+    bool active;
+    std::vector<int> compartments;
+    std::vector<int> location_map;
+    int nColumns;
+    int time_start;
+    int time_end;
+};
 
+/** Read-only model data needed to simulate an epidemic. A single copy is
+ * built by the model and shared by every simulation node; nodes keep only
+ * their own scratch space and random number generator.*/
+struct simulationModelData
+{
+    Eigen::VectorXi S0;
+    Eigen::VectorXi E0;
+    Eigen::VectorXi I0;
+    Eigen::VectorXi R0;
+    Eigen::VectorXd offset;
+    Eigen::MatrixXi Y;
+    MatrixXb na_mask;
+    int dataModelType;
+    std::vector<Eigen::MatrixXd> DM_vec;
+    std::vector<std::vector<Eigen::MatrixXd> > TDM_vec;
+    std::vector<int> TDM_empty;
+    Eigen::MatrixXd X;
+    Eigen::MatrixXd X_rs;
+    std::string transitionMode;
+    Eigen::MatrixXd E_to_I_prior;
+    Eigen::MatrixXd I_to_R_prior;
+    double inf_mean;
+    Eigen::VectorXd spatial_prior;
+    Eigen::VectorXd exposure_precision;
+    Eigen::VectorXd reinfection_precision;
+    Eigen::VectorXd exposure_mean;
+    Eigen::VectorXd reinfection_mean;
+    double phi;
+    int data_compartment;
+    bool cumulative;
+    int m;
+    /** Record compartments for all m replicates rather than the first*/
+    bool capture_replicates;
+    /** Keep only encoded transition counts for returned compartments*/
+    bool compress_compartments;
+};
+
+/** Whether a task returns only the distance to the data, or the simulated
+ * compartments as well*/
+enum taskKind {sim_task, sim_result_task};
+
+/** Compact, trivially copyable task descriptor. Parameters are not copied:
+ * the task views row param_idx of a matrix owned by the submitter, which 
+ * must outlive the task.*/
 struct instruction{
+   taskKind kind;
    int param_idx; 
-   std::string action_type;
-   Eigen::VectorXd params;
+   const Eigen::MatrixXd* params;
+   /** Precomputed exp(X*beta) and reinfection probabilities for this 
+    * particle, or nullptr to compute them in the node.*/
+   const double* eta;
+   const double* p_rs;
+};
+
+/** Completion handle for a block of tasks submitted to a NodePool*/
+class blockFuture
+{
+    public:
+        blockFuture() : pool(nullptr) {}
+        /** Whether every task of the block has finished*/
+        bool ready();
+        /** Wait for the block to finish, printing worker messages. Returns
+         * false if the block was cancelled, in which case only some of its
+         * results were written.*/
+        bool wait();
+
+    private:
+        friend class NodePool;
+        NodePool* pool;
 };
 
 class SEIR_sim_node {
     public:
         SEIR_sim_node(NodeWorker* worker,
                       int random_seed,
-                      Eigen::VectorXi S0,
-                      Eigen::VectorXi E0,
-                      Eigen::VectorXi I0,
-                      Eigen::VectorXi R0,
-                      Eigen::VectorXd offset,
-                      Eigen::MatrixXi Y,
-                      MatrixXb na_mask,
-                      int dataModelType,
-                      std::vector<Eigen::MatrixXd> DM_vec,
-                      std::vector<std::vector<Eigen::MatrixXd> > tdm_vec,
-                      std::vector<int> tdm_empty,
-                      Eigen::MatrixXd X, 
-                      Eigen::MatrixXd X_rs,
-                      std::string transitionMode,
-                      Eigen::MatrixXd ei_prior,
-                      Eigen::MatrixXd ir_prior,
-                      double avgI,
-                      Eigen::VectorXd sp_prior,
-                      Eigen::VectorXd se_prec,
-                      Eigen::VectorXd rs_prec,
-                      Eigen::VectorXd se_mean,
-                      Eigen::VectorXd rs_mean,
-                      double phi,
-                      int data_compartment,
-                      bool cumulative,
-                      int m);
+                      std::shared_ptr<const simulationModelData> data,
+                      std::shared_ptr<captureSpecification> capture,
+                      const std::atomic<bool>* cancel_token);
         ~SEIR_sim_node();
-        std::deque<std::string> messages;
-        simulationResultSet simulate(Eigen::VectorXd param_vals, bool keepCompartments);
+        simulationResultSet simulate(Eigen::VectorXd param_vals, 
+                                     bool keepCompartments,
+                                     const double* eta = nullptr,
+                                     const double* p_rs = nullptr);
 
     private: 
         NodeWorker* parent;
         unsigned int random_seed;
-        Eigen::VectorXi S0;
-        Eigen::VectorXi E0;
-        Eigen::VectorXi I0;
-        Eigen::VectorXi R0;
-        Eigen::VectorXd offset;
-        Eigen::MatrixXi Y;
-        MatrixXb na_mask;
-        int dataModelType;
-        std::vector<Eigen::MatrixXd> DM_vec;
-        std::vector<std::vector<Eigen::MatrixXd> > TDM_vec;
-        std::vector<int> TDM_empty;
-
-        Eigen::MatrixXd X;
-        Eigen::MatrixXd X_rs;
-        std::string transitionMode;
-        Eigen::MatrixXd E_to_I_prior;
-        Eigen::MatrixXd I_to_R_prior;
-        double inf_mean;
-        Eigen::VectorXd spatial_prior;
-        Eigen::VectorXd exposure_precision;
-        Eigen::VectorXd reinfection_precision;
-        Eigen::VectorXd exposure_mean;
-        Eigen::VectorXd reinfection_mean;
-        double phi;
-        int data_compartment;
-        bool cumulative;
-        int m;
+        /** Shared model data; the members below alias or copy its fields*/
+        std::shared_ptr<const simulationModelData> data;
+        const Eigen::VectorXi& S0;
+        const Eigen::VectorXi& E0;
+        const Eigen::VectorXi& I0;
+        const Eigen::VectorXi& R0;
+        const Eigen::VectorXd& offset;
+        const Eigen::MatrixXi& Y;
+        const MatrixXb& na_mask;
+        const int dataModelType;
+        const std::vector<Eigen::MatrixXd>& DM_vec;
+        const std::vector<std::vector<Eigen::MatrixXd> >& TDM_vec;
+        const std::vector<int>& TDM_empty;
+        const Eigen::MatrixXd& X;
+        const Eigen::MatrixXd& X_rs;
+        const std::string& transitionMode;
+        const Eigen::MatrixXd& E_to_I_prior;
+        const Eigen::MatrixXd& I_to_R_prior;
+        const double inf_mean;
+        const Eigen::VectorXd& spatial_prior;
+        const Eigen::VectorXd& exposure_precision;
+        const Eigen::VectorXd& reinfection_precision;
+        const Eigen::VectorXd& exposure_mean;
+        const Eigen::VectorXd& reinfection_mean;
+        const double phi;
+        const int data_compartment;
+        const bool cumulative;
+        const int m;
+        const bool capture_replicates;
+        const bool compress_compartments;
+        /** Projection of the compartments to record, owned by the model*/
+        std::shared_ptr<captureSpecification> capture;
+        /** Set by the pool when outstanding simulations should be 
+         * abandoned*/
+        const std::atomic<bool>* cancel_token;
 
         std::vector<Eigen::MatrixXi> E_paths;
         std::vector<Eigen::MatrixXi> I_paths;
@@ -109,7 +217,47 @@ class SEIR_sim_node {
         std::unique_ptr<transitionDistribution> EI_transition_dist;
         /** General I to R transition Distribution*/
         std::unique_ptr<transitionDistribution> IR_transition_dist;
-        void nodeMessage(std::string);
+        void nodeMessage(logSeverity severity, const std::string& msg);
+
+        /** Fill foi_cache with the scaled infectious fraction of each 
+         * location which currently has infectious members, and record
+         * those locations in active_locations.*/
+        void gatherInfectious(const Eigen::VectorXi& infectious,
+                              const Eigen::Map<const Eigen::MatrixXd>& components,
+                              int time_idx);
+        /** Add weight*(contact*foi_cache) to rate, visiting only the active
+         * columns of the contact matrix while the epidemic is small.*/
+        void addContactProduct(const Eigen::MatrixXd& contact, 
+                               double weight,
+                               Eigen::VectorXd& rate);
+        /** Compute S to E probabilities for one replicate, tracking the
+         * set of reachable locations (p_se > 0).*/
+        void calculateExposureProbability(const Eigen::VectorXi& infectious,
+                                          compartment_tap* lagged_infectious,
+                                          const Eigen::Map<const Eigen::MatrixXd>& components,
+                                          const Eigen::VectorXd& rho,
+                                          int time_idx,
+                                          Eigen::VectorXd& p_se);
+
+        /** Add the projection given by spec of replicate w's compartments
+         * (S, E, I, R, S_star, E_star, I_star, R_star) at time_idx to the
+         * recorded results.*/
+        void recordCompartments(simulationResultSet& results,
+                                const captureSpecification& spec,
+                                const Eigen::MatrixXi* const* sources,
+                                int time_idx,
+                                int w);
+        /** Capture specification used when none has been set: everything*/
+        captureSpecification full_capture;
+        /** Compartment indices recorded by the current simulation*/
+        std::vector<int> recorded_compartments;
+
+        /** Activity-sparse force of infection scratch space */
+        Eigen::VectorXd population;
+        Eigen::VectorXd foi_cache;
+        Eigen::VectorXd exposure_rate;
+        std::vector<int> active_locations;
+        std::vector<int> reachable_locations;
 
         int seed;
         double value;
@@ -129,104 +277,286 @@ class SEIR_sim_node {
 class NodeWorker{
     public:
         NodeWorker(NodePool* pl, 
+                   int worker_idx,
                    int random_seed,
-                   Eigen::VectorXi S0,
-                   Eigen::VectorXi E0,
-                   Eigen::VectorXi I0,
-                   Eigen::VectorXi R0,
-                   Eigen::VectorXd offset,
-                   Eigen::MatrixXi Y,
-                   MatrixXb na_mask,
-                   int dataModelType,
-                   std::vector<Eigen::MatrixXd> DM_vec,
-                   std::vector<std::vector<Eigen::MatrixXd> > TDM_vec,
-                   std::vector<int> TDM_empty,
-                   Eigen::MatrixXd X, 
-                   Eigen::MatrixXd X_rs,
-                   std::string transitionMode,
-                   Eigen::MatrixXd ei_prior,
-                   Eigen::MatrixXd ir_prior,
-                   double avgI,
-                   Eigen::VectorXd sp_prior,
-                   Eigen::VectorXd se_prec,
-                   Eigen::VectorXd rs_prec,
-                   Eigen::VectorXd se_mean,
-                   Eigen::VectorXd rs_mean,
-                   double phi,
-                   int data_compartment,
-                   bool cumulative,
-                   int m);
-        void operator()();
-        void addMessage(std::string);
+                   std::shared_ptr<const simulationModelData> data,
+                   std::shared_ptr<captureSpecification> capture,
+                   const std::atomic<bool>* cancel_token);
+        /** Claim and run the next chunk of tasks, returning false if none
+         * were available*/
+        bool runNext();
+        /** Log a message from this worker's thread*/
+        void addMessage(logSeverity severity, const std::string& msg);
+        /** Messages logged by this worker, drained by NodePool*/
+        std::unique_ptr<logRing> log_ring;
 
     private:
         friend class SEIR_sim_node;
+        /** Simulate one task and store its results in its own row and
+         * slot*/
+        void runTask(const instruction& task);
         NodePool* pool;
+        /** This worker's range in NodePool::ranges*/
+        int worker_idx;
+        /** Chooses steal victims; kept apart from the simulation generator
+         * so scheduling does not perturb the simulated epidemics*/
+        std::minstd_rand victim_generator;
         std::unique_ptr<SEIR_sim_node> node;
 };
 
+/** Process wide set of worker threads, started once and shared by every 
+ * model. Each model's NodePool attaches as a context holding its own 
+ * simulation nodes and work, and thread i serves worker slot i of every
+ * context with at least i+1 slots. The number of threads is the largest
+ * CPU_cores requested so far, so concurrently live models share that 
+ * budget rather than each starting their own threads.*/
+class sharedThreadPool{
+    public:
+        static sharedThreadPool& instance();
+        /** Register a context with the given number of worker slots, 
+         * starting threads until there are at least that many. If pin is
+         * set, every thread is pinned to its CPU (see workerPlacement)
+         * until the last context asking for pinning detaches.*/
+        void attach(NodePool* context, int threads, bool pin);
+        /** Remove a context, waiting until no thread is running its tasks,
+         * and unpin the threads if no remaining context asked for pinning*/
+        void detach(NodePool* context);
+        /** Wake idle threads after work is published on a context*/
+        void notify();
+        /** Whether spinning can pay off with nThreads workers, that is
+         * whether they and the R thread each have a core of their own*/
+        static bool spinUseful(int nThreads);
+        ~sharedThreadPool();
+
+    private:
+        sharedThreadPool();
+        void workerLoop(int worker_idx);
+        /** An attached context with work for worker_idx, or nullptr. 
+         * Must be called holding mutex.*/
+        NodePool* findWork(int worker_idx);
+        /** Take the largest spin budget of the attached contexts. Must be
+         * called holding mutex.*/
+        void updateSpin();
+
+        std::vector<std::thread> threads;
+        std::vector<NodePool*> contexts;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::condition_variable detached;
+        /** Threads blocked on condition; producers skip the notify (and
+         * its lock) when there are none.*/
+        std::atomic_int nWaiting;
+        /** Advanced whenever work is published, so spinning threads need
+         * not take mutex to notice it*/
+        std::atomic<unsigned int> work_epoch;
+        /** Microseconds an idle thread spins before parking*/
+        std::atomic_int spin_us;
+        bool exit;
+        /** Attached contexts which asked for pinned threads; the threads
+         * are pinned while there are any*/
+        std::vector<NodePool*> pinning;
+};
+
 class NodePool{
     public:
         NodePool(Eigen::MatrixXd* result_pointer,
                  std::vector<simulationResultSet>* result_complete_pointer,
-                 std::vector<int>* index_pointer,
                  int threads,
                  int random_seed,
-                 Eigen::VectorXi S0,
-                 Eigen::VectorXi E0,
-                 Eigen::VectorXi I0,
-                 Eigen::VectorXi R0,
-                 Eigen::VectorXd offset,
-                 Eigen::MatrixXi Y,
-                 MatrixXb na_mask,
-                 int dataModelType,
-                 std::vector<Eigen::MatrixXd> DM_vec,
-                 std::vector<std::vector<Eigen::MatrixXd> > TDM_vec,
-                 std::vector<int> TDM_empty,
-                 Eigen::MatrixXd X, 
-                 Eigen::MatrixXd X_rs,
-                 std::string transitionMode,
-                 Eigen::MatrixXd ei_prior,
-                 Eigen::MatrixXd ir_prior,
-                 double avgI,
-                 Eigen::VectorXd sp_prior,
-                 Eigen::VectorXd se_prec,
-                 Eigen::VectorXd rs_prec,
-                 Eigen::VectorXd se_mean,
-                 Eigen::VectorXd rs_mean,
-                 double phi,
-                 int data_compartment,
-                 bool cumulative,
-                 int m
-              );
+                 std::shared_ptr<const simulationModelData> data,
+                 std::shared_ptr<captureSpecification> capture,
+                 bool pin_workers,
+                 int spin_wait_us,
+                 backendKind backend,
+                 const std::vector<std::string>& remote_workers);
+        /** Results of particle i are written to row i of result_pointer
+         * and, for sim_result_task, slot i of result_complete_pointer, 
+         * which must already hold a slot for every submitted particle.*/
         void setResultsDest(Eigen::MatrixXd* result_pointer,
                             std::vector<simulationResultSet>* result_complete_pointer);
-        void awaitFinished();
-        void resolveMessages();
-        void enqueue(std::string action_type, int param_idx, Eigen::VectorXd params);
+        /** Wait for every submitted task, printing worker messages and 
+         * polling for R interrupts. An interrupt cancels the outstanding
+         * tasks, and false is returned once those already running have 
+         * stopped.*/
+        bool awaitFinished();
+        /** Wait until the results of particle param_idx have been written,
+         * or no tasks remain. Returns false if the wait was interrupted, as
+         * for awaitFinished.*/
+        bool awaitTask(int param_idx);
+        /** Mark particles [0, n) as unfinished before a batch of that size
+         * is submitted. Must only be called while the pool is idle.*/
+        void resetCompletion(int n);
+        /** Refit the cost predictor to the runtimes of the particles which
+         * finished in the last batch, whose parameters were params. Later
+         * blocks are dispatched most expensive first. Must only be called
+         * while the pool is idle, before resetCompletion.*/
+        void fitCostModel(const Eigen::MatrixXd& params);
+        /** Abandon every task which has not yet started, and ask running
+         * simulations to stop early. Their results are not written.*/
+        void cancel();
+        /** Print the messages logged by the workers. Unless force is set,
+         * nothing is done if the logs were drained less than LOG_DRAIN_MS
+         * ago. Must be called from the R thread.*/
+        void drainLog(bool force);
+        /** Publish rows [first, first + count) of params as a single block
+         * of tasks, evaluating their linear predictors first. Workers claim
+         * chunks of the block themselves, so submission costs one wakeup
+         * regardless of count. Returns without waiting; the caller may do 
+         * other work until it waits on the returned handle. Must only be 
+         * called while the pool is idle.*/
+        blockFuture submitBlock(taskKind kind, const Eigen::MatrixXd* params, 
+                                int first, int count);
+        /** Run body(i) for each i in [0, count) on the local worker slots,
+         * and wait for every call to return. Remote workers take no part.
+         * Returns false if the wait was interrupted, in which case only 
+         * some of the calls were made. Must only be called while the pool
+         * is idle.*/
+        bool parallelFor(int count, const std::function<void(int)>& body);
+        /** Number of particles whose linear predictors fit within 
+         * LINEAR_PREDICTOR_BLOCK_BYTES*/
+        int linearPredictorBlockSize();
+        /** Evaluate exp(X*beta) and the reinfection probabilities for each
+         * row of params with one matrix product apiece, storing particle i
+         * in column i of eta_block and p_rs_block. Must only be called 
+         * while the pool is idle.*/
+        void computeLinearPredictors(const Eigen::MatrixXd& params);
+        Eigen::MatrixXd eta_block;
+        Eigen::MatrixXd p_rs_block;
         Eigen::MatrixXd* result_pointer;
-        std::deque<std::string> messages;
         std::vector<simulationResultSet>* result_complete_pointer;
-        std::vector<int>* index_pointer;
         ~NodePool();
 
     private:
         friend class NodeWorker;
-        
+        friend class blockFuture;
+        friend class sharedThreadPool;
+        friend class remoteProxy;
+        friend class serialBackend;
+        friend class threadBackend;
+        friend class openmpBackend;
+        std::shared_ptr<const simulationModelData> data;
+        std::shared_ptr<captureSpecification> capture;
+        /** Copies of data for each NUMA node when workers are pinned, so
+         * that simulations read node local memory*/
+        std::vector<std::shared_ptr<const simulationModelData> > data_replicas;
+        /** Worker slots: nLocal served by the shared threads, followed by
+         * one per remote worker*/
+        int nThreads;
+        int nLocal;
+        /** Proxies of the remote worker slots, in slot order*/
+        std::vector<std::unique_ptr<remoteProxy> > remotes;
+        /** Relative share of each block a slot starts with*/
+        int slotWeight(int slot);
+
+        /** Claim the next chunk of worker's range of the published block,
+         * stealing from another worker if that range is empty. Chunks 
+         * shrink as the range is consumed (guided scheduling).*/
+        bool claimChunk(int worker, std::minstd_rand& victim_generator,
+                        int& chunkStart, int& chunkSize);
+        /** Move the back half of a randomly chosen non-empty range to
+         * worker's own range, which was last seen as emptyCursor. If that
+         * range has since been refilled, the stolen tasks are returned as
+         * a chunk instead.*/
+        bool stealRange(int worker, std::minstd_rand& victim_generator,
+                        std::uint64_t emptyCursor, int& chunkStart, 
+                        int& chunkSize);
+        /** Claim the next chunk of the published parallelFor range*/
+        bool claimKernel(int& chunkStart, int& chunkSize);
+        /** Whether the published block has unclaimed tasks*/
+        bool blockAvailable();
+        /** Whether any submitted task is unclaimed*/
+        bool hasWork();
+        /** Task descriptor for particle idx of the published block*/
+        instruction blockTask(int idx);
+        /** Particle at position pos of the published block's dispatch 
+         * order*/
+        int blockParticle(int pos);
+        /** Deal rows [first, first + count) of params to the worker ranges
+         * by predicted cost, longest first, each range going to the slot 
+         * whose predicted finishing time is least. Ranges are laid out in 
+         * block_order, most expensive first, so that thieves take the
+         * cheapest tasks.*/
+        void scheduleByCost(const Eigen::MatrixXd* params, int first, int count);
+        /** Record completion of n tasks, waking awaitFinished after the last*/
+        void completeTasks(int n);
+        /** Whether the results of particle param_idx have been written*/
+        bool taskDone(int param_idx);
+        /** Record the time taken to simulate particle param_idx*/
+        void recordCost(int param_idx, double seconds);
+        /** Flag the results of particle param_idx as written, waking 
+         * awaitTask if it is waiting for that particle*/
+        void finishTask(int param_idx);
+        /** Whether a wait for particle param_idx or, for a negative index,
+         * for every task is over*/
+        bool waitSatisfied(int param_idx);
+        /** Block the R thread until waitSatisfied(param_idx), printing 
+         * worker messages and polling for interrupts meanwhile. If 
+         * wake_for_work is set, also return when unclaimed tasks appear,
+         * as when a remote worker hands its tasks back.*/
+        void park(int param_idx, bool wake_for_work);
+        /** Wake the R thread if it is parked*/
+        void wakeParked();
+        /** Print worker messages and check for an interrupt, cancelling
+         * the outstanding tasks on one, unless this was done less than 
+         * INTERRUPT_POLL_MS ago. For backends which run tasks on the R 
+         * thread, between tasks.*/
+        void pollInterrupt();
+        std::chrono::steady_clock::time_point last_interrupt_poll;
+        /** Runs the tasks of the local worker slots*/
+        std::unique_ptr<executionBackend> backend;
 
-#ifdef SPATIALSEIR_SINGLETHREAD
+        taskKind block_kind;
+        const Eigen::MatrixXd* block_params;
+        int block_first;
+        /** Each worker's share of the published block, packed as 
+         * (end << 32) | next. The owner claims from next, and thieves take
+         * from end; both ends live in one word so a single compare and
+         * swap settles any race.*/
+        struct workRange
+        {
+            std::atomic<std::uint64_t> cursor;
+            char pad[64 - sizeof(std::atomic<std::uint64_t>)];
+        };
+        std::unique_ptr<workRange[]> ranges;
+        /** Indices of the function published by parallelFor, packed as for
+         * ranges but shared by the local workers*/
+        workRange kernel_range;
+        const std::function<void(int)>* kernel;
+        /** Per particle completion flags of the current batch*/
+        std::unique_ptr<std::atomic<bool>[]> task_done;
+        int task_done_capacity;
+        /** Seconds taken by each finished particle of the current batch, or
+         * zero. CPU time is used where the platform provides it.*/
+        std::unique_ptr<double[]> task_cost;
+        taskCostModel cost_model;
+        /** Particle index of each position of the published block, or 
+         * empty to dispatch in index order*/
+        std::vector<int> block_order;
+        /** Particle awaitTask is blocked on, or -1*/
+        std::atomic_int awaited_task;
+        std::chrono::steady_clock::time_point last_drain;
+
+        /** Simulation state for each worker slot. Reserved up front, so
+         * the nodes' pointers to their workers stay valid.*/
         std::vector<NodeWorker> nodes;
-#else
-        std::vector<std::thread> nodes;
-#endif
-        std::deque<instruction>  tasks;
-        std::atomic_int nBusy;
+        boundedTaskQueue<instruction> tasks;
+        /** Tasks submitted and not yet completed*/
+        std::atomic_int nPending;
+        /** Shared threads currently running this context's tasks; guarded
+         * by the sharedThreadPool mutex*/
+        int nActive;
+        /** Threads blocked on finished; completions skip the notify (and
+         * its lock) when there are none.*/
+        std::atomic_int nParked;
+        /** Microseconds to spin, waiting for results or for work, before
+         * blocking. Zero blocks at once.*/
+        int spin_us;
 
         std::mutex queue_mutex;
-        std::mutex result_mutex;
-        std::condition_variable condition;
         std::condition_variable finished;
-        bool exit; 
+        /** Cancellation token shared with the simulation nodes. Cleared
+         * when new work is submitted.*/
+        std::atomic<bool> cancelled;
 };
 
 
@@ -0,0 +1,83 @@
+#ifndef ABSEIR_EXECUTION_BACKEND_HDR
+#define ABSEIR_EXECUTION_BACKEND_HDR
+
+#include <chrono>
+#include <memory>
+
+class NodePool;
+
+/** Ways of running the local worker slots of a NodePool. The numbering is
+ * that of SamplingControl's backend option.*/
+enum backendKind {backend_serial = 0, backend_threads = 1, backend_openmp = 2};
+
+/** Runs the tasks a NodePool publishes on its local worker slots. The pool
+ * owns the work ranges and completion state; a backend decides which
+ * threads serve the slots, and how the R thread waits for results. Remote
+ * worker slots are served by their own proxies under every backend.*/
+class executionBackend
+{
+    public:
+        virtual ~executionBackend() {}
+        /** Backend of the given kind. Throws std::runtime_error if it isn't
+         * available in this build.*/
+        static std::unique_ptr<executionBackend> create(backendKind kind);
+        /** Whether the given kind can be created in this build*/
+        static bool available(backendKind kind);
+        /** Number of local worker slots to use when threads are requested*/
+        virtual int localSlots(int threads) = 0;
+        /** Whether tasks only run while the R thread waits for them*/
+        virtual bool runsOnCaller() = 0;
+        /** Start serving pool, whose local slots have been created. If pin
+         * is set, the backend may pin its threads to CPUs.*/
+        virtual void attach(NodePool* pool, bool pin) = 0;
+        /** Stop serving pool, returning once no thread runs its tasks*/
+        virtual void detach(NodePool* pool) = 0;
+        /** Work has been published on pool*/
+        virtual void notify(NodePool* pool) = 0;
+        /** Run or wait for pool's tasks until particle param_idx has
+         * finished or, for a negative index, none remain. An interrupt
+         * cancels the outstanding tasks. Must be called from the R thread.*/
+        virtual void await(NodePool* pool, int param_idx) = 0;
+};
+
+// Tell the core that this is a spin loop, easing pressure on the sibling
+// hyperthread and on the memory system.
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Spin waits read the clock once every SPIN_CLOCK_INTERVAL polls
+#define SPIN_CLOCK_INTERVAL 64
+
+/** Spin until ready() holds or budget_us microseconds pass, returning
+ * whether it held*/
+template <typename Predicate>
+bool spinWait(Predicate ready, int budget_us)
+{
+    if (budget_us <= 0)
+    {
+        return(false);
+    }
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::microseconds(budget_us);
+    for (int itr = 1; ; itr++)
+    {
+        if (ready())
+        {
+            return(true);
+        }
+        cpuRelax();
+        if (itr % SPIN_CLOCK_INTERVAL == 0 &&
+                std::chrono::steady_clock::now() >= deadline)
+        {
+            return(ready());
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef ABSEIR_KERNEL_DENSITY_TREE_HDR
+#define ABSEIR_KERNEL_DENSITY_TREE_HDR
+
+#include <vector>
+#include <Eigen/Core>
+
+// Leaves of a kernelDensityTree hold at most KD_TREE_LEAF_SIZE points
+#define KD_TREE_LEAF_SIZE 64
+// Taylor expansions of node kernel sums are truncated at the highest
+// order, up to KD_TREE_MAX_ORDER, with at most KD_TREE_MAX_TERMS
+// coefficients
+#define KD_TREE_MAX_TERMS 512
+#define KD_TREE_MAX_ORDER 12
+
+/** KD-tree over weighted points, estimating sums of Gaussian kernels,
+ *   sum_j weight_j*exp(-0.5*|query - point_j|^2),
+ * to within a relative tolerance. Each node's contribution is taken, in
+ * order of preference, from the bounds on its kernel values, from a
+ * truncated Taylor expansion about its centroid (as in the improved fast
+ * Gauss transform), or from its children, whichever first has an error
+ * bound within the node's share of the tolerance. Queries may run
+ * concurrently.*/
+class kernelDensityTree
+{
+    public:
+        /** Build over the columns of points, with non-negative weights.
+         * Both are copied.*/
+        kernelDensityTree(const Eigen::MatrixXd& points,
+                          const Eigen::VectorXd& weights);
+        /** Log of the kernel sum at query, with relative error at most
+         * tolerance. Returns -infinity if the sum underflows, so that the
+         * caller can fall back to an exact evaluation.*/
+        double logKernelSum(const Eigen::VectorXd& query,
+                            double tolerance) const;
+
+    private:
+        struct node
+        {
+            /** Range of the (tree ordered) points held by the node*/
+            int begin;
+            int end;
+            /** Children, or -1 for a leaf*/
+            int left;
+            int right;
+            double weight;
+            /** Bounding box of the node's points*/
+            Eigen::VectorXd lower;
+            Eigen::VectorXd upper;
+            /** Centroid, and largest distance of a point from it*/
+            Eigen::VectorXd center;
+            double radius;
+            /** Taylor coefficients of the node's kernel sum about center,
+             * or empty where the node is too small for them to pay*/
+            Eigen::VectorXd moments;
+        };
+        /** Running totals of a query*/
+        struct queryState
+        {
+            /** Squared distance the kernels are scaled by*/
+            double shift;
+            double tolerance;
+            double sum;
+            /** Lower bound on the sum*/
+            double lowerBound;
+            /** Error bound of the approximations made so far*/
+            double error;
+            /** Weight of the nodes evaluated so far*/
+            double weightDone;
+        };
+        /** Build the node over the points [begin, end) of point_order,
+         * returning its index*/
+        int build(int begin, int end);
+        /** Fill in the centroids, radii and Taylor coefficients, once the
+         * points are in tree order*/
+        void summarize(node& n);
+        /** Monomials u^alpha of the expansion's multi-indices*/
+        void monomials(const Eigen::VectorXd& u, Eigen::VectorXd& out) const;
+        /** Bounds on the squared distance from query to any point of n*/
+        void distanceBounds(const node& n, const Eigen::VectorXd& query,
+                            double& minDist, double& maxDist) const;
+        /** Add the scaled kernel sum of node idx to state*/
+        void accumulate(int idx, const Eigen::VectorXd& query,
+                        queryState& state) const;
+
+        /** Points in tree order, one per column*/
+        Eigen::MatrixXd points;
+        Eigen::VectorXd weights;
+        std::vector<int> point_order;
+        std::vector<node> nodes;
+        double total_weight;
+        /** Expansion order: multi-indices of total degree below order are
+         * kept. Each multi-index past the first extends an earlier one,
+         * term_parent, by one in dimension term_dim, and term_coef holds
+         * 2^|alpha|/alpha!.*/
+        int order;
+        std::vector<int> term_parent;
+        std::vector<int> term_dim;
+        Eigen::VectorXd term_coef;
+        /** Nodes with fewer points are evaluated from their children*/
+        int min_expansion_points;
+};
+
+#endif
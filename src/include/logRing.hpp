@@ -0,0 +1,115 @@
+#ifndef ABSEIR_LOG_RING_HDR
+#define ABSEIR_LOG_RING_HDR
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+
+// Entries a worker's log holds before further messages are dropped, and
+// the longest message kept; longer messages are truncated.
+#define LOG_RING_CAPACITY 64
+#define LOG_ENTRY_BYTES 240
+
+// Each worker may log LOG_RATE_LIMIT messages below error severity per
+// LOG_RATE_WINDOW_MS milliseconds; the rest are counted and dropped.
+#define LOG_RATE_LIMIT 20
+#define LOG_RATE_WINDOW_MS 1000
+
+enum logSeverity {log_info, log_warning, log_error};
+
+/** Lock free single producer, single consumer ring of log messages. Each
+ * worker owns one and writes to it without locking or allocating; the R
+ * thread drains every worker's ring from time to time. Messages which
+ * exceed the rate limit, or find the ring full, are dropped and counted.*/
+class logRing
+{
+    public:
+        logRing()
+        {
+            head.store(0, std::memory_order_relaxed);
+            tail.store(0, std::memory_order_relaxed);
+            dropped.store(0, std::memory_order_relaxed);
+            window_count = 0;
+        }
+
+        /** Record a message. Must only be called by the owning worker.*/
+        void push(logSeverity severity, const std::string& msg)
+        {
+            if (severity != log_error && !withinRate())
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            const std::size_t pos = head.load(std::memory_order_relaxed);
+            if (pos - tail.load(std::memory_order_acquire) >= LOG_RING_CAPACITY)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            entry& target = slots[pos % LOG_RING_CAPACITY];
+            target.severity = severity;
+            target.length = std::min(msg.size(), (std::size_t) LOG_ENTRY_BYTES);
+            std::memcpy(target.text, msg.data(), target.length);
+            head.store(pos + 1, std::memory_order_release);
+        }
+
+        /** Remove the oldest message, returning false if there is none.
+         * Must only be called by the draining thread.*/
+        bool pop(logSeverity& severity, std::string& msg)
+        {
+            const std::size_t pos = tail.load(std::memory_order_relaxed);
+            if (pos == head.load(std::memory_order_acquire))
+            {
+                return(false);
+            }
+            const entry& source = slots[pos % LOG_RING_CAPACITY];
+            severity = source.severity;
+            msg.assign(source.text, source.length);
+            tail.store(pos + 1, std::memory_order_release);
+            return(true);
+        }
+
+        /** Number of messages dropped since the last call*/
+        int takeDropped()
+        {
+            return(dropped.exchange(0, std::memory_order_relaxed));
+        }
+
+    private:
+        /** Count a message against the current rate window*/
+        bool withinRate()
+        {
+            const std::chrono::steady_clock::time_point now =
+                std::chrono::steady_clock::now();
+            if (window_count == 0 || now - window_start >=
+                    std::chrono::milliseconds(LOG_RATE_WINDOW_MS))
+            {
+                window_start = now;
+                window_count = 0;
+            }
+            return(++window_count <= LOG_RATE_LIMIT);
+        }
+
+        struct entry
+        {
+            logSeverity severity;
+            std::size_t length;
+            char text[LOG_ENTRY_BYTES];
+        };
+        entry slots[LOG_RING_CAPACITY];
+        /** Rate limit state, touched only by the producer*/
+        std::chrono::steady_clock::time_point window_start;
+        int window_count;
+        // The producer and consumer update separate cache lines
+        char pad_0[64];
+        std::atomic<std::size_t> head;
+        char pad_1[64];
+        std::atomic<std::size_t> tail;
+        char pad_2[64];
+        std::atomic_int dropped;
+};
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef ABSEIR_REMOTE_WORKER_HDR
+#define ABSEIR_REMOTE_WORKER_HDR
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <stdexcept>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <Eigen/Core>
+#include <SEIRSimNodes.hpp>
+#include <spatialSEIRModel.hpp>
+
+// Version of the remote worker protocol; workers refuse other versions.
+#define REMOTE_PROTOCOL_VERSION 1
+
+// Clients retry connecting to a remote worker for up to this long, so that
+// workers started alongside the model have time to listen.
+#define REMOTE_CONNECT_TIMEOUT_MS 10000
+
+// A worker which hasn't answered a cancelled batch within this long is
+// dropped, and the batch's tasks are returned to the pool.
+#define REMOTE_CANCEL_TIMEOUT_MS 10000
+
+// A proxy ships about REMOTE_TASKS_PER_CORE particles per remote worker
+// thread in each batch, which bounds both the work lost when a connection
+// fails and how long a cancelled batch runs on.
+#define REMOTE_TASKS_PER_CORE 4
+
+// Both ends poll their sockets this often, in milliseconds, while checking
+// for interrupts and cancellation.
+#define REMOTE_POLL_MS 50
+
+/** Failure of a remote worker connection or protocol*/
+class remoteError : public std::runtime_error
+{
+    public:
+        remoteError(const std::string& what) : std::runtime_error(what) {}
+};
+
+/** Serializer for messages exchanged with remote workers. Values are
+ * written in native byte order; the handshake checks that both ends
+ * agree on it.*/
+class messageWriter
+{
+    public:
+        std::vector<char> bytes;
+
+        template <typename T>
+        typename std::enable_if<std::is_arithmetic<T>::value>::type
+        put(const T& value)
+        {
+            putArray(&value, 1);
+        }
+
+        template <typename T>
+        void putArray(const T* values, std::size_t n)
+        {
+            const char* start = reinterpret_cast<const char*>(values);
+            bytes.insert(bytes.end(), start, start + n*sizeof(T));
+        }
+
+        void put(const std::string& value)
+        {
+            put((std::int64_t) value.size());
+            putArray(value.data(), value.size());
+        }
+
+        template <typename T>
+        typename std::enable_if<std::is_arithmetic<T>::value>::type
+        put(const std::vector<T>& values)
+        {
+            put((std::int64_t) values.size());
+            putArray(values.data(), values.size());
+        }
+
+        template <typename T>
+        typename std::enable_if<!std::is_arithmetic<T>::value>::type
+        put(const std::vector<T>& values)
+        {
+            put((std::int64_t) values.size());
+            for (unsigned int i = 0; i < values.size(); i++)
+            {
+                put(values[i]);
+            }
+        }
+
+        template <typename Scalar, int R, int C, int O, int MR, int MC>
+        void put(const Eigen::Matrix<Scalar, R, C, O, MR, MC>& value)
+        {
+            put((std::int64_t) value.rows());
+            put((std::int64_t) value.cols());
+            putArray(value.data(), value.size());
+        }
+};
+
+/** Reader for messages written by messageWriter. Reading past the end of
+ * the message throws remoteError.*/
+class messageReader
+{
+    public:
+        messageReader(const std::vector<char>& msg) : bytes(msg), pos(0) {}
+
+        template <typename T>
+        typename std::enable_if<std::is_arithmetic<T>::value>::type
+        get(T& value)
+        {
+            getArray(&value, 1);
+        }
+
+        template <typename T>
+        void getArray(T* values, std::size_t n)
+        {
+            if (n*sizeof(T) > bytes.size() - pos)
+            {
+                throw remoteError("truncated message");
+            }
+            std::memcpy(reinterpret_cast<char*>(values), &bytes[0] + pos,
+                        n*sizeof(T));
+            pos += n*sizeof(T);
+        }
+
+        std::int64_t getSize()
+        {
+            std::int64_t n;
+            get(n);
+            if (n < 0 || n > (std::int64_t) (bytes.size() - pos))
+            {
+                throw remoteError("invalid length in message");
+            }
+            return(n);
+        }
+
+        void get(std::string& value)
+        {
+            value.resize(getSize());
+            if (!value.empty())
+            {
+                getArray(&value[0], value.size());
+            }
+        }
+
+        template <typename T>
+        typename std::enable_if<std::is_arithmetic<T>::value>::type
+        get(std::vector<T>& values)
+        {
+            values.resize(getSize());
+            getArray(values.data(), values.size());
+        }
+
+        template <typename T>
+        typename std::enable_if<!std::is_arithmetic<T>::value>::type
+        get(std::vector<T>& values)
+        {
+            values.resize(getSize());
+            for (unsigned int i = 0; i < values.size(); i++)
+            {
+                get(values[i]);
+            }
+        }
+
+        template <typename Scalar, int R, int C, int O, int MR, int MC>
+        void get(Eigen::Matrix<Scalar, R, C, O, MR, MC>& value)
+        {
+            std::int64_t rows, cols;
+            get(rows);
+            get(cols);
+            if (rows < 0 || cols < 0 || (cols > 0 && rows >
+                        (std::int64_t) (bytes.size() - pos)/((std::int64_t) sizeof(Scalar)*cols)))
+            {
+                throw remoteError("invalid matrix size in message");
+            }
+            value.resize(rows, cols);
+            getArray(value.data(), value.size());
+        }
+
+    private:
+        const std::vector<char>& bytes;
+        std::size_t pos;
+};
+
+void writeModelData(messageWriter& out, const simulationModelData& data);
+void readModelData(messageReader& in, simulationModelData& data);
+void writeCapture(messageWriter& out, const captureSpecification& capture);
+void readCapture(messageReader& in, captureSpecification& capture);
+void writeResultSet(messageWriter& out, const simulationResultSet& result);
+void readResultSet(messageReader& in, simulationResultSet& result);
+
+/** Client end of a connection to a remote worker process started with
+ * SimulationWorker. The worker receives a copy of the model data once,
+ * then simulates batches of particles with its own threads.*/
+class remoteConnection
+{
+    public:
+        /** Connect to address, given as tcp://host:port, host:port or
+         * unix:///path/to/socket, and send the model data. Throws 
+         * remoteError on failure.*/
+        remoteConnection(const std::string& address,
+                         const simulationModelData& data,
+                         int random_seed);
+        ~remoteConnection();
+        /** Simulate every row of params, writing row i of the results to
+         * row i of results and, for sim_result_task, to slot i of 
+         * result_sets. If cancel_token is set while waiting, the worker is
+         * asked to abandon the batch, and false is returned. Throws 
+         * remoteError if the connection fails.*/
+        bool simulate(taskKind kind,
+                      const captureSpecification& capture,
+                      const Eigen::MatrixXd& params,
+                      Eigen::MatrixXd& results,
+                      std::vector<simulationResultSet>& result_sets,
+                      const std::atomic<bool>& cancel_token);
+        /** Worker threads available at the remote end*/
+        int cores;
+        std::string address;
+
+    private:
+        int fd;
+};
+
+/** Worker slot of a NodePool which is served by a remote worker. A proxy
+ * thread claims chunks of the published block for the slot, as a local
+ * worker would, and ships them to the remote end in batches. If the 
+ * connection fails, the claimed tasks are handed back to the local 
+ * workers and the slot takes no further work.*/
+class remoteProxy
+{
+    public:
+        remoteProxy(NodePool* pool, int slot, 
+                    std::unique_ptr<remoteConnection> connection);
+        ~remoteProxy();
+        /** Share of a block the slot should start with: its worker count
+         * while the connection is up, else zero*/
+        int weight();
+        /** Wake the proxy after a block is published*/
+        void notify();
+        /** Messages from the proxy thread, drained by NodePool*/
+        logRing log_ring;
+
+    private:
+        void run();
+        /** Give the claimed tasks back to the local workers*/
+        void requeue(const std::vector<int>& claimed);
+
+        NodePool* pool;
+        int slot;
+        std::unique_ptr<remoteConnection> connection;
+        std::minstd_rand victim_generator;
+        std::atomic<bool> alive;
+        bool stop;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        std::thread thread;
+};
+
+/** Serve simulations to remote clients at address until interrupted, 
+ * using the given number of threads. If once is set, return after the 
+ * first client disconnects. Returns the number of particles simulated in
+ * completed batches.*/
+double serveSimulations(const std::string& address, int cores, bool once);
+
+#endif
@@ -1,8 +1,6 @@
 #ifndef SPATIALSEIR_SAMPLING_CONTROL
 #define SPATIALSEIR_SAMPLING_CONTROL
 
-//#define SPATIALSEIR_SINGLETHREAD
-
 #define ALG_BasicABC 1
 #define ALG_ModifiedBeaumont2009 2
 #define ALG_DelMoral2012 3
@@ -10,6 +8,7 @@
 
 #include <Rcpp.h>
 #include<modelComponent.hpp>
+#include<executionBackend.hpp>
 
 
 using namespace Rcpp;
@@ -23,6 +22,12 @@ class samplingControl : public modelComponent
         ~samplingControl();
     void summary();
     int getModelComponentType();
+    /** Addresses of remote simulation workers to use alongside the local
+     * threads (see SimulationWorker)*/
+    void setRemoteWorkers(SEXP addresses);
+    /** Core count and batch sizes in use, with the calibration results
+     * they were chosen from when auto tuning*/
+    Rcpp::List getTuning();
     int simulation_width;
     int random_seed;
     int algorithm;
@@ -36,6 +41,27 @@ class samplingControl : public modelComponent
     int epochs;
     int m;
     bool multivariatePerturbation;
+    bool capture_replicates;
+    bool compress_compartments;
+    bool pin_workers;
+    int spin_wait_us;
+    /** How local simulations are run: serially on the R thread, on the
+     * shared worker threads, or in OpenMP parallel regions*/
+    backendKind backend;
+    std::vector<std::string> remote_workers;
+    /** Choose CPU_cores (as an upper bound), batch_size and 
+     * init_batch_size by timing simulations at model construction*/
+    bool auto_tune;
+    /** Wall time, in seconds, an auto tuned batch should take*/
+    double target_batch_seconds;
+    /** Relative error allowed in the kernel densities of the Beaumont 
+     * importance weights; zero computes them exactly*/
+    double weight_tolerance;
+    /** Calibration results: mean seconds per simulation on one core, and
+     * simulations per second with each number of cores tried*/
+    double tuned_simulation_seconds;
+    std::vector<int> tuned_cores;
+    std::vector<double> tuned_throughput;
 };
 
 
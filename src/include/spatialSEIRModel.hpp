@@ -13,6 +13,46 @@
 #include "./SEIRSimNodes.hpp"
 #include "./transitionPriors.hpp"
 #include "./transitionDistribution.hpp"
+#include "./trajectoryCodec.hpp"
+
+// Auto tuning times simulations of prior draws in rounds of at least 
+// AUTO_TUNE_ROUND_SECONDS, and stops trying more cores once calibration
+// has taken AUTO_TUNE_MAX_SECONDS. Each round gives every core at least
+// AUTO_TUNE_TASKS_PER_CORE particles, and draws on at most 
+// AUTO_TUNE_MAX_PARTICLES of them.
+#define AUTO_TUNE_ROUND_SECONDS 0.25
+#define AUTO_TUNE_MAX_SECONDS 10.0
+#define AUTO_TUNE_TASKS_PER_CORE 4
+#define AUTO_TUNE_MAX_PARTICLES 65536
+// Doubling the cores must raise throughput by AUTO_TUNE_MIN_GAIN for more
+// to be tried, and the fewest cores within AUTO_TUNE_EFFICIENCY of the 
+// best throughput are used.
+#define AUTO_TUNE_MIN_GAIN 1.1
+#define AUTO_TUNE_EFFICIENCY 0.95
+// Largest batch auto tuning will choose
+#define AUTO_TUNE_MAX_BATCH 1000000
+
+// Beaumont importance weights are computed BEAUMONT_WEIGHT_BLOCK_ROWS 
+// proposed particles to a worker task, each block taking one GEMM against
+// the previous particles.
+#define BEAUMONT_WEIGHT_BLOCK_ROWS 32
+
+/** Log densities at the rows of proposed of the mixture of normals about
+ * the rows of previous, with mixture weights prev_weights, from which 
+ * Beaumont 2009 proposals are drawn. The normals have independent scales 
+ * tau or, if L is not empty, covariance L L^T for lower triangular L. A 
+ * positive tolerance allows that relative error in each density, which is 
+ * then estimated with a kernelDensityTree. Blocks of proposals run on pool,
+ * or on the calling thread if it is null. Returns false if the pool was 
+ * cancelled.*/
+bool beaumontLogKernel(const Eigen::MatrixXd& proposed,
+                       const Eigen::MatrixXd& previous,
+                       const Eigen::VectorXd& prev_weights,
+                       const Eigen::VectorXd& tau,
+                       const Eigen::MatrixXd& L,
+                       double tolerance,
+                       NodePool* pool,
+                       Eigen::VectorXd& logKernel);
 
 struct samplingResultSet
 {
@@ -37,6 +77,12 @@ struct simulationResultSet
     Eigen::MatrixXd rho;
     Eigen::MatrixXd beta;
     Eigen::MatrixXd result; 
+    /** Encoded transition counts, used in place of the compartment 
+     * matrices above when compartments are compressed.*/
+    std::vector<unsigned char> S_star_code;
+    std::vector<unsigned char> E_star_code;
+    std::vector<unsigned char> I_star_code;
+    std::vector<unsigned char> R_star_code;
 };
 
 class dataModel;
@@ -67,6 +113,12 @@ class spatialSEIRModel
         Rcpp::List sample(SEXP nSample, SEXP returnComps, SEXP verbose);
         /** Evaluate the prior distribution of a particular set of parameters*/
         double evalPrior(Eigen::VectorXd param_values);
+        /** Restrict the compartments recorded for each particle to a subset
+         * of compartments, a (possibly aggregated) set of locations, and
+         * a time window. See captureSpecification.*/
+        void setCaptureSpecification(SEXP compartments, 
+                                     SEXP locationMap,
+                                     SEXP timeWindow);
         /** Assign the parameter values manually */
         bool setParameters(Eigen::MatrixXd param_values, 
                            Eigen::VectorXd weights,
@@ -94,12 +146,52 @@ class spatialSEIRModel
         /** Set parameters from prior distribution*/
         Eigen::MatrixXd generateParamsPrior(int N);
 
+        /** Choose the core count and batch sizes of samplingControlInstance
+         * by timing simulations of prior draws with increasing numbers of
+         * cores, up to CPU_cores (or every core, if CPU_cores is zero). 
+         * Batches are sized to take target_batch_seconds. Remote workers
+         * are not timed. Must be called before the worker pool is built.*/
+        void autoTune(std::shared_ptr<const simulationModelData> modelData);
+
         /** Simulate epidemics based on parameters*/
         void run_simulations(Eigen::MatrixXd params, 
                              std::string sim_type_atom,
                              Eigen::MatrixXd* result_recip,
                              std::vector<simulationResultSet>* result_c_recip);
 
+        /** Start simulating epidemics based on parameters and return 
+         * without waiting, so that the next batch can be prepared while 
+         * the workers run. Results must not be read until 
+         * finish_simulations returns.*/
+        void begin_simulations(Eigen::MatrixXd params, 
+                               std::string sim_type_atom,
+                               Eigen::MatrixXd* result_recip,
+                               std::vector<simulationResultSet>* result_c_recip);
+
+        /** Wait for the simulations started by begin_simulations. If the 
+         * user interrupts, outstanding simulations are cancelled and the 
+         * interrupt is raised in R.*/
+        void finish_simulations();
+
+        /** Wait for particle idx of the simulations started by 
+         * begin_simulations, so that results can be consumed in 
+         * submission order as they arrive. Interrupts are handled as for
+         * finish_simulations.*/
+        void await_simulation(int idx);
+
+        /** Abandon the simulations started by begin_simulations which
+         * have not yet finished. Their results are left unwritten. Returns
+         * once no simulation is running, so the result buffers and the
+         * parameters may then be reused or freed.*/
+        void cancel_simulations();
+
+        /** Submit the next block of the pending simulations*/
+        void submit_next_block();
+
+        /** Abandon the pending simulations after the pool has consumed an
+         * interrupt, and raise it in R*/
+        void raise_interrupt();
+
         /** Run simulation using basic ABC algorithm */
         Rcpp::List sample_basic(int nSample, int verbose, 
                                 std::string sim_type_atom);
@@ -108,6 +200,18 @@ class spatialSEIRModel
         Rcpp::List sample_Beaumont2009(int nSample, int verbose, 
                                 std::string sim_type_atom);
 
+        /** Normalized Beaumont 2009 importance weights of the proposed
+         * particles, which were perturbed from previous (with weights 
+         * prev_weights) by independent normals with scales tau or, for 
+         * multivariate perturbation, by the cached proposal covariance.
+         * The kernel densities come from beaumontLogKernel, to within 
+         * weight_tolerance. Waits for abandoned simulations, and runs on 
+         * the worker pool.*/
+        Eigen::VectorXd beaumontWeights(const Eigen::MatrixXd& proposed,
+                                        const Eigen::MatrixXd& previous,
+                                        const Eigen::VectorXd& prev_weights,
+                                        const Eigen::VectorXd& tau);
+
         /** Run simulation using Del Moral 2012 algorithm */
         Rcpp::List sample_DelMoral2012(int nSample, int verbose, 
                                 std::string sim_type_atom);
@@ -115,6 +219,11 @@ class spatialSEIRModel
         /** Use current parameters to simulate epidemics*/
         Rcpp::List sample_Simulate(int nSample, int enforceEps, int verbose);
 
+        /** Convert a single simulation result to the list returned to R. 
+         * When all replicates are captured, compartments are returned as 
+         * arrays of dimension (time, location, replicate).*/
+        Rcpp::List wrapSimulationResult(const simulationResultSet& simResult);
+
         /** Flag for whether params have been initialized*/
         bool is_initialized;
 
@@ -145,9 +254,6 @@ class spatialSEIRModel
         /** Matrix of parameters */
         Eigen::MatrixXd prev_param_matrix;  
 
-        /** Result index vector */
-        std::vector<int> result_idx;
-
         /** Results vector*/
         Eigen::MatrixXd results_double;
 
@@ -193,9 +299,25 @@ class spatialSEIRModel
         /** Pointer to a samplingControl object.*/
         samplingControl* samplingControlInstance;
 
+        /** Compartment projection shared with the simulation nodes. Only 
+         * modified while the worker pool is idle.*/
+        std::shared_ptr<captureSpecification> capture;
+
+        /** Parameters of the simulations started by begin_simulations; 
+         * the workers read them in place, so they are declared 
+         * before (and destroyed after) the worker pool.*/
+        Eigen::MatrixXd pending_params;
+        /** Task kind of the pending simulations*/
+        taskKind pending_kind;
+        /** First particle of the pending simulations not yet submitted*/
+        int pending_next;
+        /** Handle for the block of pending simulations in flight*/
+        blockFuture pending_block;
+
         /** Thread pool */
         std::unique_ptr<NodePool> worker_pool; 
 
+
         /** A persistant pointer to a properly initialized random 
          * number generator.*/
         std::mt19937* generator;
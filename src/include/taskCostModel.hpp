@@ -0,0 +1,118 @@
+#ifndef ABSEIR_TASK_COST_MODEL_HDR
+#define ABSEIR_TASK_COST_MODEL_HDR
+
+#include <cmath>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+
+// The cost model is only fitted with at least COST_MODEL_MIN_SAMPLES timed
+// particles (and four per coefficient), and only used if it explains at
+// least COST_MODEL_MIN_R2 of the variance of log runtime.
+#define COST_MODEL_MIN_SAMPLES 32
+#define COST_MODEL_MIN_R2 0.1
+// Ridge penalty, relative to the number of samples, on the standardized
+// coefficients
+#define COST_MODEL_RIDGE 1e-3
+
+/** Predicts the relative cost of simulating a particle from its
+ * parameters, by ridge regression of log runtime on the parameters and
+ * their squares. Epidemic size, and so runtime, grows quickly with the
+ * transmission parameters, which the squares let the fit follow. Only the
+ * ordering of the predictions matters.*/
+class taskCostModel
+{
+    public:
+        taskCostModel() : fitted(false) {}
+
+        /** Refit to the first n rows of params, using row i if cost[i], its
+         * runtime, is positive. The previous fit is kept if there are too
+         * few timed rows, and dropped if the new fit has no predictive
+         * value.*/
+        void fit(const Eigen::MatrixXd& params, const double* cost, int n)
+        {
+            const int nFeatures = 2*params.cols();
+            std::vector<int> rows;
+            int i, j;
+            for (i = 0; i < n; i++)
+            {
+                if (cost[i] > 0 && params.row(i).allFinite())
+                {
+                    rows.push_back(i);
+                }
+            }
+            const int k = rows.size();
+            if (k < COST_MODEL_MIN_SAMPLES || k < 4*(nFeatures + 1))
+            {
+                return;
+            }
+            Eigen::MatrixXd Z(k, nFeatures);
+            Eigen::VectorXd y(k);
+            for (i = 0; i < k; i++)
+            {
+                Z.row(i) = rawFeatures(params.row(rows[i])).transpose();
+                y(i) = std::log(cost[rows[i]]);
+            }
+            center = Z.colwise().mean().transpose();
+            Z.rowwise() -= center.transpose();
+            scale = (Z.colwise().squaredNorm()/k).cwiseSqrt().transpose();
+            for (j = 0; j < nFeatures; j++)
+            {
+                if (!(scale(j) > 0))
+                {
+                    scale(j) = 1.0;
+                }
+            }
+            Z = Z*(scale.cwiseInverse().asDiagonal());
+            intercept = y.mean();
+            y.array() -= intercept;
+
+            Eigen::MatrixXd gram = Z.transpose()*Z;
+            gram.diagonal().array() += COST_MODEL_RIDGE*k;
+            coef = gram.ldlt().solve(Z.transpose()*y);
+            const double total = y.squaredNorm();
+            const double residual = (y - Z*coef).squaredNorm();
+            fitted = (coef.allFinite() && total > 0 &&
+                      1.0 - residual/total >= COST_MODEL_MIN_R2);
+        }
+
+        /** Whether a usable fit exists for particles with nParams
+         * parameters*/
+        bool ready(int nParams) const
+        {
+            return(fitted && 2*nParams == coef.size());
+        }
+
+        /** Predicted log cost of each row of params. Rows which can't be
+         * predicted get the average.*/
+        Eigen::VectorXd predict(const Eigen::MatrixXd& params) const
+        {
+            Eigen::VectorXd out(params.rows());
+            for (int i = 0; i < params.rows(); i++)
+            {
+                out(i) = intercept +
+                    ((rawFeatures(params.row(i)) - center).cwiseQuotient(scale)).dot(coef);
+                if (!std::isfinite(out(i)))
+                {
+                    out(i) = intercept;
+                }
+            }
+            return(out);
+        }
+
+    private:
+        static Eigen::VectorXd rawFeatures(const Eigen::RowVectorXd& row)
+        {
+            Eigen::VectorXd out(2*row.size());
+            out << row.transpose(), row.transpose().cwiseAbs2();
+            return(out);
+        }
+
+        Eigen::VectorXd center;
+        Eigen::VectorXd scale;
+        Eigen::VectorXd coef;
+        double intercept;
+        bool fitted;
+};
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef ABSEIR_TASK_QUEUE_HDR
+#define ABSEIR_TASK_QUEUE_HDR
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+/** Bounded lock free multi producer, multi consumer queue of trivially
+ * copyable items. Each slot carries a sequence number which tells producers
+ * and consumers whether it is free to write or ready to read, so push and
+ * pop need a single compare and swap in the uncontended case. Capacity is
+ * rounded up to a power of two.*/
+template <typename T>
+class boundedTaskQueue
+{
+    public:
+        boundedTaskQueue(std::size_t capacity)
+        {
+            std::size_t size = 2;
+            while (size < capacity)
+            {
+                size *= 2;
+            }
+            mask = size - 1;
+            slots = std::vector<slot>(size);
+            for (std::size_t i = 0; i < size; i++)
+            {
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            enqueue_pos.store(0, std::memory_order_relaxed);
+            dequeue_pos.store(0, std::memory_order_relaxed);
+        }
+
+        /** Add an item, returning false if the queue is full.*/
+        bool push(const T& item)
+        {
+            slot* target;
+            std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                target = &slots[pos & mask];
+                std::size_t seq = target -> sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = (std::ptrdiff_t) seq - (std::ptrdiff_t) pos;
+                if (diff == 0)
+                {
+                    if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return(false);
+                }
+                else
+                {
+                    pos = enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            target -> item = item;
+            target -> sequence.store(pos + 1, std::memory_order_release);
+            return(true);
+        }
+
+        /** Remove the oldest item into out, returning false if the queue
+         * is empty.*/
+        bool pop(T& out)
+        {
+            slot* source;
+            std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                source = &slots[pos & mask];
+                std::size_t seq = source -> sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = (std::ptrdiff_t) seq - (std::ptrdiff_t) (pos + 1);
+                if (diff == 0)
+                {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return(false);
+                }
+                else
+                {
+                    pos = dequeue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            out = source -> item;
+            source -> sequence.store(pos + mask + 1, std::memory_order_release);
+            return(true);
+        }
+
+        /** Whether any item has been claimed for writing and not yet for
+         * reading. Only a hint while other threads are active.*/
+        bool empty() const
+        {
+            return(enqueue_pos.load(std::memory_order_seq_cst) ==
+                   dequeue_pos.load(std::memory_order_seq_cst));
+        }
+
+    private:
+        struct slot
+        {
+            std::atomic<std::size_t> sequence;
+            T item;
+        };
+        std::vector<slot> slots;
+        std::size_t mask;
+        // Producers and consumers update separate cache lines
+        char pad_0[64];
+        std::atomic<std::size_t> enqueue_pos;
+        char pad_1[64];
+        std::atomic<std::size_t> dequeue_pos;
+        char pad_2[64];
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef SPATIALSEIR_TRAJECTORY_CODEC
+#define SPATIALSEIR_TRAJECTORY_CODEC
+
+#include <vector>
+#include <Eigen/Core>
+
+/** Compact storage for simulated transition counts. Each column of a 
+ * (time x location) count matrix is delta coded along time, zigzag mapped
+ * to unsigned values and written as LEB128 varints. Counts change slowly 
+ * between time points, so most entries occupy a single byte.*/
+void encodeTransitionCounts(const Eigen::MatrixXi& counts,
+                            std::vector<unsigned char>& out);
+
+/** Inverse of encodeTransitionCounts for a matrix of known dimension.*/
+Eigen::MatrixXi decodeTransitionCounts(const unsigned char* bytes,
+                                       size_t nBytes,
+                                       int nrow,
+                                       int ncol);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef ABSEIR_WORKER_PLACEMENT_HDR
+#define ABSEIR_WORKER_PLACEMENT_HDR
+
+#include <vector>
+#include <thread>
+
+/** Processor topology used to pin worker threads. Workers are spread
+ * round robin over the NUMA nodes, and over the CPUs within each node, so
+ * worker i always lands on the same CPU. Topology is read from sysfs on
+ * Linux; elsewhere the machine is treated as a single node and pinning is
+ * unavailable.*/
+class workerPlacement
+{
+    public:
+        /** Topology of the machine, read once*/
+        static const workerPlacement& instance();
+        int numaNodes() const;
+        /** NUMA node of the CPU that worker_idx is pinned to*/
+        int nodeForWorker(int worker_idx) const;
+        /** Pin a thread to the CPU of worker_idx, returning false if
+         * pinning is unsupported or failed*/
+        bool pinWorker(std::thread::native_handle_type thread,
+                       int worker_idx) const;
+        /** Give a pinned thread back every CPU the process was allowed
+         * when the topology was read*/
+        bool unpinWorker(std::thread::native_handle_type thread) const;
+        /** Pin the calling thread to the CPUs of a NUMA node*/
+        bool pinToNode(int node) const;
+
+    private:
+        workerPlacement();
+        /** CPUs of each NUMA node that this process may run on*/
+        std::vector<std::vector<int> > node_cpus;
+        /** Every CPU this process may run on*/
+        std::vector<int> allowed_cpus;
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <kernelDensityTree.hpp>
+
+kernelDensityTree::kernelDensityTree(const Eigen::MatrixXd& inPoints,
+                                     const Eigen::VectorXd& inWeights)
+{
+    const int N = inPoints.cols();
+    const int p = inPoints.rows();
+    int i, k, t;
+
+    // Multi-indices of total degree below order, in graded order. Each
+    // extends its parent in a dimension no lower than the parent's last,
+    // so that every multi-index is generated once.
+    std::vector<Eigen::VectorXi> exponents(1, Eigen::VectorXi::Zero(p));
+    std::vector<int> lastDim(1, 0);
+    std::vector<double> coef(1, 1.0);
+    term_parent.assign(1, -1);
+    term_dim.assign(1, -1);
+    order = 1;
+    int degreeStart = 0;
+    while (true)
+    {
+        const int degreeEnd = exponents.size();
+        std::vector<Eigen::VectorXi> nextExponents;
+        std::vector<int> nextParent, nextDim, nextLastDim;
+        std::vector<double> nextCoef;
+        for (t = degreeStart; t < degreeEnd; t++)
+        {
+            for (k = lastDim[t]; k < p; k++)
+            {
+                nextExponents.push_back(exponents[t]);
+                nextExponents.back()(k)++;
+                nextParent.push_back(t);
+                nextDim.push_back(k);
+                nextLastDim.push_back(k);
+                nextCoef.push_back(coef[t]*2.0/nextExponents.back()(k));
+            }
+        }
+        if (nextExponents.empty() || order >= KD_TREE_MAX_ORDER ||
+                exponents.size() + nextExponents.size() > KD_TREE_MAX_TERMS)
+        {
+            break;
+        }
+        for (t = 0; t < (int) nextExponents.size(); t++)
+        {
+            exponents.push_back(nextExponents[t]);
+            term_parent.push_back(nextParent[t]);
+            term_dim.push_back(nextDim[t]);
+            lastDim.push_back(nextLastDim[t]);
+            coef.push_back(nextCoef[t]);
+        }
+        degreeStart = degreeEnd;
+        order++;
+    }
+    const int nTerms = coef.size();
+    term_coef = Eigen::Map<Eigen::VectorXd>(coef.data(), nTerms);
+    // An expansion costs a few operations per term, against a few per
+    // point for the node's exact sum. Its coefficients take about 64 bytes
+    // per point.
+    min_expansion_points = std::max(2*KD_TREE_LEAF_SIZE, nTerms/4);
+
+    point_order.resize(N);
+    for (i = 0; i < N; i++)
+    {
+        point_order[i] = i;
+    }
+    points = inPoints;
+    weights = inWeights;
+    total_weight = weights.sum();
+    if (N > 0)
+    {
+        build(0, N);
+    }
+    // Store the points in tree order, so that every node's are contiguous
+    Eigen::MatrixXd ordered(p, N);
+    Eigen::VectorXd orderedWeights(N);
+    for (i = 0; i < N; i++)
+    {
+        ordered.col(i) = points.col(point_order[i]);
+        orderedWeights(i) = weights(point_order[i]);
+    }
+    points.swap(ordered);
+    weights.swap(orderedWeights);
+    for (i = 0; i < (int) nodes.size(); i++)
+    {
+        summarize(nodes[i]);
+    }
+}
+
+int kernelDensityTree::build(int begin, int end)
+{
+    const int idx = nodes.size();
+    nodes.push_back(node());
+    node& n = nodes.back();
+    n.begin = begin;
+    n.end = end;
+    n.left = -1;
+    n.right = -1;
+    n.lower = points.col(point_order[begin]);
+    n.upper = n.lower;
+    for (int i = begin; i < end; i++)
+    {
+        n.lower = n.lower.cwiseMin(points.col(point_order[i]));
+        n.upper = n.upper.cwiseMax(points.col(point_order[i]));
+    }
+    if (end - begin <= KD_TREE_LEAF_SIZE)
+    {
+        return(idx);
+    }
+    // Split at the median of the widest dimension
+    int dim;
+    (n.upper - n.lower).maxCoeff(&dim);
+    const int middle = begin + (end - begin)/2;
+    std::nth_element(point_order.begin() + begin, point_order.begin() + middle,
+                     point_order.begin() + end, [this, dim](int a, int b){
+                         return(points(dim, a) < points(dim, b));});
+    // Building the children may reallocate nodes
+    const int left = build(begin, middle);
+    const int right = build(middle, end);
+    nodes[idx].left = left;
+    nodes[idx].right = right;
+    return(idx);
+}
+
+void kernelDensityTree::summarize(node& n)
+{
+    const int count = n.end - n.begin;
+    n.weight = weights.segment(n.begin, count).sum();
+    n.center = points.middleCols(n.begin, count).rowwise().mean();
+    n.radius = std::sqrt((points.middleCols(n.begin, count).colwise() -
+                n.center).colwise().squaredNorm().maxCoeff());
+    if (n.left < 0 || count < min_expansion_points)
+    {
+        return;
+    }
+    // With the kernel exp(-|x - y|^2/h^2), h^2 = 2, and u = (x - c)/h,
+    // v = (y - c)/h about the centroid c,
+    //   exp(-|x - y|^2/h^2) = exp(-|u|^2) exp(-|v|^2) exp(2 u.v)
+    // and exp(2 u.v) = sum_alpha 2^|alpha|/alpha! u^alpha v^alpha.
+    n.moments = Eigen::VectorXd::Zero(term_coef.size());
+    Eigen::VectorXd v, mono;
+    for (int i = n.begin; i < n.end; i++)
+    {
+        v = (points.col(i) - n.center)/std::sqrt(2.0);
+        monomials(v, mono);
+        n.moments += (weights(i)*std::exp(-v.squaredNorm()))*mono;
+    }
+    n.moments.array() *= term_coef.array();
+}
+
+void kernelDensityTree::monomials(const Eigen::VectorXd& u,
+                                  Eigen::VectorXd& out) const
+{
+    out.resize(term_coef.size());
+    out(0) = 1.0;
+    for (int t = 1; t < (int) term_coef.size(); t++)
+    {
+        out(t) = out(term_parent[t])*u(term_dim[t]);
+    }
+}
+
+void kernelDensityTree::distanceBounds(const node& n,
+                                       const Eigen::VectorXd& query,
+                                       double& minDist, double& maxDist) const
+{
+    minDist = 0.0;
+    maxDist = 0.0;
+    for (int k = 0; k < query.size(); k++)
+    {
+        const double below = n.lower(k) - query(k);
+        const double above = query(k) - n.upper(k);
+        const double gap = std::max(0.0, std::max(below, above));
+        const double reach = std::max(std::abs(below), std::abs(above));
+        minDist += gap*gap;
+        maxDist += reach*reach;
+    }
+    // The ball about the centroid is often tighter than the box
+    const double toCenter = (query - n.center).norm();
+    const double inner = std::max(0.0, toCenter - n.radius);
+    const double outer = toCenter + n.radius;
+    minDist = std::max(minDist, inner*inner);
+    maxDist = std::min(maxDist, outer*outer);
+}
+
+void kernelDensityTree::accumulate(int idx, const Eigen::VectorXd& query,
+                                   queryState& state) const
+{
+    const node& n = nodes[idx];
+    if (n.left < 0)
+    {
+        const int count = n.end - n.begin;
+        const double leafSum = weights.segment(n.begin, count).dot(
+                (-0.5*((points.middleCols(n.begin, count).colwise() -
+                        query).colwise().squaredNorm().array() -
+                       state.shift)).exp().matrix().transpose());
+        state.sum += leafSum;
+        state.lowerBound += leafSum;
+        state.weightDone += n.weight;
+        return;
+    }
+    // Approximations are allowed error up to the evaluated share of the
+    // tolerance, so that the total stays within tolerance*lowerBound.
+    // Exact sums leave their share to later nodes.
+    const double allowed = state.tolerance*state.lowerBound*
+        (state.weightDone + n.weight)/total_weight - state.error;
+
+    // Every kernel value of the node lies between those at its box's
+    // nearest and farthest corners; take the midpoint.
+    double minDist, maxDist;
+    distanceBounds(n, query, minDist, maxDist);
+    const double maxKernel = std::exp(-0.5*(minDist - state.shift));
+    const double minKernel = std::exp(-0.5*(maxDist - state.shift));
+    const double boundError = 0.5*n.weight*(maxKernel - minKernel);
+    if (boundError <= allowed)
+    {
+        state.sum += 0.5*n.weight*(maxKernel + minKernel);
+        state.lowerBound += n.weight*minKernel;
+        state.error += boundError;
+        state.weightDone += n.weight;
+        return;
+    }
+
+    // Truncating exp(2 u.v) after total degree order - 1 errs by at most
+    // (2|u||v|)^order/order! exp(2|u||v|) for each point, so the node's
+    // error is at most weight*(2ab)^order/order! exp(-(a - b)^2), with
+    // a = |u| and b = radius/h.
+    if (n.moments.size() > 0 && n.weight > 0)
+    {
+        const Eigen::VectorXd u = (query - n.center)/std::sqrt(2.0);
+        const double a = u.norm();
+        const double b = n.radius/std::sqrt(2.0);
+        const double gap = std::max(0.0, a - b);
+        const double expansionError = (2.0*a*b > 0 ? std::exp(
+                    std::log(n.weight) + order*std::log(2.0*a*b) -
+                    std::lgamma(order + 1.0) - gap*gap + 0.5*state.shift) : 0.0);
+        if (expansionError <= allowed)
+        {
+            Eigen::VectorXd mono;
+            monomials(u, mono);
+            const double value = std::exp(-a*a + 0.5*state.shift)*
+                mono.dot(n.moments);
+            state.sum += value;
+            state.lowerBound += std::max(n.weight*minKernel,
+                                         value - expansionError);
+            state.error += expansionError;
+            state.weightDone += n.weight;
+            return;
+        }
+    }
+
+    // The nearer child first, so that the lower bound grows quickly
+    double leftMin, rightMin, unused;
+    distanceBounds(nodes[n.left], query, leftMin, unused);
+    distanceBounds(nodes[n.right], query, rightMin, unused);
+    const int first = (leftMin <= rightMin ? n.left : n.right);
+    const int second = (first == n.left ? n.right : n.left);
+    accumulate(first, query, state);
+    accumulate(second, query, state);
+}
+
+double kernelDensityTree::logKernelSum(const Eigen::VectorXd& query,
+                                       double tolerance) const
+{
+    if (nodes.empty() || !(total_weight > 0))
+    {
+        return(-std::numeric_limits<double>::infinity());
+    }
+    // Kernels are scaled by the nearest point of the query's leaf, so
+    // that a query far from every point doesn't underflow the sum.
+    int idx = 0;
+    double leftMin, rightMin, unused;
+    while (nodes[idx].left >= 0)
+    {
+        distanceBounds(nodes[nodes[idx].left], query, leftMin, unused);
+        distanceBounds(nodes[nodes[idx].right], query, rightMin, unused);
+        idx = (leftMin <= rightMin ? nodes[idx].left : nodes[idx].right);
+    }
+    queryState state;
+    state.shift = std::numeric_limits<double>::infinity();
+    for (int i = nodes[idx].begin; i < nodes[idx].end; i++)
+    {
+        state.shift = std::min(state.shift, (points.col(i) - query).squaredNorm());
+    }
+    state.tolerance = tolerance;
+    state.sum = 0.0;
+    state.lowerBound = 0.0;
+    state.error = 0.0;
+    state.weightDone = 0.0;
+    accumulate(0, query, state);
+    if (!(state.sum > 0) || !std::isfinite(state.sum))
+    {
+        return(-std::numeric_limits<double>::infinity());
+    }
+    return(std::log(state.sum) - 0.5*state.shift);
+}
@@ -0,0 +1,1017 @@
+#include <Rcpp.h>
+#include <remoteWorker.hpp>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Every frame starts with this tag, its type and the length of its body
+static const std::uint32_t FRAME_MAGIC = 0x41425352;
+// Written by the client in its own byte order; a worker which reads it
+// differently can't exchange raw values with that client.
+static const std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+// Upper bounds on frame bodies, so that a corrupt or hostile length is
+// rejected rather than allocated. Only frames carrying model data,
+// parameters or results may be large.
+static const std::uint64_t MAX_DATA_FRAME_BYTES = ((std::uint64_t) 1) << 30;
+static const std::uint64_t MAX_MESSAGE_FRAME_BYTES = ((std::uint64_t) 1) << 16;
+// Bodies are received this much at a time, so that memory is only taken
+// for bytes which actually arrive
+static const std::size_t FRAME_CHUNK_BYTES = ((std::size_t) 1) << 20;
+
+enum frameType
+{
+    frame_hello = 1,   // client: version, byte order, seed, model data
+    frame_ready = 2,   // worker: thread count
+    frame_batch = 3,   // client: task kind, capture, parameters
+    frame_results = 4, // worker: completion flag, results
+    frame_cancel = 5,  // client: abandon the running batch
+    frame_error = 6,   // either: description of a fatal error
+    frame_bye = 7      // client: no further batches
+};
+
+void writeModelData(messageWriter& out, const simulationModelData& data)
+{
+    out.put(data.S0);
+    out.put(data.E0);
+    out.put(data.I0);
+    out.put(data.R0);
+    out.put(data.offset);
+    out.put(data.Y);
+    out.put(data.na_mask);
+    out.put(data.dataModelType);
+    out.put(data.DM_vec);
+    out.put(data.TDM_vec);
+    out.put(data.TDM_empty);
+    out.put(data.X);
+    out.put(data.X_rs);
+    out.put(data.transitionMode);
+    out.put(data.E_to_I_prior);
+    out.put(data.I_to_R_prior);
+    out.put(data.inf_mean);
+    out.put(data.spatial_prior);
+    out.put(data.exposure_precision);
+    out.put(data.reinfection_precision);
+    out.put(data.exposure_mean);
+    out.put(data.reinfection_mean);
+    out.put(data.phi);
+    out.put(data.data_compartment);
+    out.put(data.cumulative);
+    out.put(data.m);
+    out.put(data.capture_replicates);
+    out.put(data.compress_compartments);
+}
+
+void readModelData(messageReader& in, simulationModelData& data)
+{
+    in.get(data.S0);
+    in.get(data.E0);
+    in.get(data.I0);
+    in.get(data.R0);
+    in.get(data.offset);
+    in.get(data.Y);
+    in.get(data.na_mask);
+    in.get(data.dataModelType);
+    in.get(data.DM_vec);
+    in.get(data.TDM_vec);
+    in.get(data.TDM_empty);
+    in.get(data.X);
+    in.get(data.X_rs);
+    in.get(data.transitionMode);
+    in.get(data.E_to_I_prior);
+    in.get(data.I_to_R_prior);
+    in.get(data.inf_mean);
+    in.get(data.spatial_prior);
+    in.get(data.exposure_precision);
+    in.get(data.reinfection_precision);
+    in.get(data.exposure_mean);
+    in.get(data.reinfection_mean);
+    in.get(data.phi);
+    in.get(data.data_compartment);
+    in.get(data.cumulative);
+    in.get(data.m);
+    in.get(data.capture_replicates);
+    in.get(data.compress_compartments);
+}
+
+void writeCapture(messageWriter& out, const captureSpecification& capture)
+{
+    out.put(capture.active);
+    if (capture.active)
+    {
+        out.put(capture.compartments);
+        out.put(capture.location_map);
+        out.put(capture.nColumns);
+        out.put(capture.time_start);
+        out.put(capture.time_end);
+    }
+}
+
+void readCapture(messageReader& in, captureSpecification& capture)
+{
+    in.get(capture.active);
+    if (capture.active)
+    {
+        in.get(capture.compartments);
+        in.get(capture.location_map);
+        in.get(capture.nColumns);
+        in.get(capture.time_start);
+        in.get(capture.time_end);
+    }
+}
+
+void writeResultSet(messageWriter& out, const simulationResultSet& result)
+{
+    out.put(result.S);
+    out.put(result.E);
+    out.put(result.I);
+    out.put(result.R);
+    out.put(result.S_star);
+    out.put(result.E_star);
+    out.put(result.I_star);
+    out.put(result.R_star);
+    out.put(result.X);
+    out.put(result.p_se);
+    out.put(result.p_ei);
+    out.put(result.p_ir);
+    out.put(result.rho);
+    out.put(result.beta);
+    out.put(result.result);
+    out.put(result.S_star_code);
+    out.put(result.E_star_code);
+    out.put(result.I_star_code);
+    out.put(result.R_star_code);
+}
+
+void readResultSet(messageReader& in, simulationResultSet& result)
+{
+    in.get(result.S);
+    in.get(result.E);
+    in.get(result.I);
+    in.get(result.R);
+    in.get(result.S_star);
+    in.get(result.E_star);
+    in.get(result.I_star);
+    in.get(result.R_star);
+    in.get(result.X);
+    in.get(result.p_se);
+    in.get(result.p_ei);
+    in.get(result.p_ir);
+    in.get(result.rho);
+    in.get(result.beta);
+    in.get(result.result);
+    in.get(result.S_star_code);
+    in.get(result.E_star_code);
+    in.get(result.I_star_code);
+    in.get(result.R_star_code);
+}
+
+#ifndef _WIN32
+static std::string systemError(const std::string& what)
+{
+    return(what + ": " + std::strerror(errno));
+}
+
+static void sendAll(int fd, const char* buffer, std::size_t n)
+{
+    ssize_t sent;
+    while (n > 0)
+    {
+        sent = send(fd, buffer, n, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw remoteError(systemError("send failed"));
+        }
+        buffer += sent;
+        n -= sent;
+    }
+}
+
+static void recvAll(int fd, char* buffer, std::size_t n)
+{
+    ssize_t received;
+    while (n > 0)
+    {
+        received = recv(fd, buffer, n, 0);
+        if (received == 0)
+        {
+            throw remoteError("connection closed");
+        }
+        if (received < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw remoteError(systemError("receive failed"));
+        }
+        buffer += received;
+        n -= received;
+    }
+}
+
+static void sendFrame(int fd, frameType type, const messageWriter& body)
+{
+    messageWriter header;
+    header.put(FRAME_MAGIC);
+    header.put((unsigned char) type);
+    header.put((std::uint64_t) body.bytes.size());
+    sendAll(fd, header.bytes.data(), header.bytes.size());
+    sendAll(fd, body.bytes.data(), body.bytes.size());
+}
+
+static void sendError(int fd, const std::string& what)
+{
+    messageWriter body;
+    body.put(what);
+    try
+    {
+        sendFrame(fd, frame_error, body);
+    }
+    catch (const remoteError&)
+    {
+        // The peer is gone anyway
+    }
+}
+
+/** Largest body allowed for a frame of type, or zero for unknown types*/
+static std::uint64_t maxFrameBytes(unsigned char type)
+{
+    switch (type)
+    {
+        case frame_hello:
+        case frame_batch:
+        case frame_results:
+            return(MAX_DATA_FRAME_BYTES);
+        case frame_ready:
+        case frame_error:
+            return(MAX_MESSAGE_FRAME_BYTES);
+        default:
+            return(0);
+    }
+}
+
+/** Receive the next frame into body, returning its type. Error frames are
+ * raised as remoteError.*/
+static frameType recvFrame(int fd, std::vector<char>& body)
+{
+    const std::size_t headerSize = sizeof(std::uint32_t) + 1 +
+        sizeof(std::uint64_t);
+    std::vector<char> header(headerSize);
+    std::uint32_t magic;
+    unsigned char type;
+    std::uint64_t length;
+    recvAll(fd, header.data(), headerSize);
+    messageReader in(header);
+    in.get(magic);
+    in.get(type);
+    in.get(length);
+    if (magic != FRAME_MAGIC)
+    {
+        throw remoteError("invalid frame; is this a simulation worker?");
+    }
+    // Cancel and bye frames have empty bodies
+    if (length > maxFrameBytes(type) ||
+            (type != frame_cancel && type != frame_bye && 
+             maxFrameBytes(type) == 0))
+    {
+        throw remoteError("invalid frame type or length");
+    }
+    body.clear();
+    std::size_t received = 0;
+    while (received < length)
+    {
+        const std::size_t chunk = std::min((std::size_t) (length - received),
+                                           FRAME_CHUNK_BYTES);
+        body.resize(received + chunk);
+        recvAll(fd, body.data() + received, chunk);
+        received += chunk;
+    }
+    if (type == frame_error)
+    {
+        std::string what;
+        messageReader err(body);
+        err.get(what);
+        throw remoteError(what);
+    }
+    return((frameType) type);
+}
+
+/** Wait up to timeout_ms for fd to become readable (or to close)*/
+static bool waitReadable(int fd, int timeout_ms)
+{
+    struct pollfd request;
+    request.fd = fd;
+    request.events = POLLIN;
+    request.revents = 0;
+    return(poll(&request, 1, timeout_ms) > 0);
+}
+
+static void configureSocket(int fd, bool tcp)
+{
+    int on = 1;
+    if (tcp)
+    {
+        // Batches are written whole; don't hold back their last segment
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+/** Parsed worker address: a unix socket path, or a TCP host and port*/
+struct socketAddress
+{
+    bool local;
+    std::string path;
+    std::string host;
+    std::string port;
+};
+
+static socketAddress parseAddress(const std::string& address)
+{
+    socketAddress out;
+    std::string rest = address;
+    out.local = (rest.compare(0, 7, "unix://") == 0);
+    if (out.local)
+    {
+        out.path = rest.substr(7);
+        if (out.path.empty() || out.path.size() >= sizeof(((sockaddr_un*) 0) -> sun_path))
+        {
+            throw remoteError("invalid unix socket path: " + address);
+        }
+        return(out);
+    }
+    if (rest.compare(0, 6, "tcp://") == 0)
+    {
+        rest = rest.substr(6);
+    }
+    const std::size_t colon = rest.rfind(':');
+    if (colon == std::string::npos || colon + 1 == rest.size())
+    {
+        throw remoteError("worker address must be tcp://host:port or "
+                          "unix:///path: " + address);
+    }
+    out.host = rest.substr(0, colon);
+    out.port = rest.substr(colon + 1);
+    // Allow bracketed IPv6 addresses such as [::1]:5000
+    if (out.host.size() >= 2 && out.host[0] == '[' &&
+            out.host[out.host.size() - 1] == ']')
+    {
+        out.host = out.host.substr(1, out.host.size() - 2);
+    }
+    return(out);
+}
+
+static int openUnixSocket(const std::string& path, sockaddr_un& addr)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        throw remoteError(systemError("socket failed"));
+    }
+    return(fd);
+}
+
+/** Make one attempt to connect to address, returning the socket or -1*/
+static int tryConnect(const socketAddress& address, std::string& failure)
+{
+    int fd;
+    if (address.local)
+    {
+        sockaddr_un addr;
+        fd = openUnixSocket(address.path, addr);
+        if (connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0)
+        {
+            failure = systemError("connect failed");
+            close(fd);
+            return(-1);
+        }
+        configureSocket(fd, false);
+        return(fd);
+    }
+    struct addrinfo hints;
+    struct addrinfo* candidates;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(address.host.c_str(), address.port.c_str(),
+                             &hints, &candidates);
+    if (status != 0)
+    {
+        failure = std::string("address lookup failed: ") + gai_strerror(status);
+        return(-1);
+    }
+    fd = -1;
+    for (struct addrinfo* itr = candidates; itr != NULL; itr = itr -> ai_next)
+    {
+        fd = socket(itr -> ai_family, itr -> ai_socktype, itr -> ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+        if (connect(fd, itr -> ai_addr, itr -> ai_addrlen) == 0)
+        {
+            break;
+        }
+        failure = systemError("connect failed");
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(candidates);
+    if (fd >= 0)
+    {
+        configureSocket(fd, true);
+    }
+    return(fd);
+}
+
+static int openListener(const socketAddress& address)
+{
+    int fd;
+    if (address.local)
+    {
+        sockaddr_un addr;
+        struct stat existing;
+        // Replace the socket of an earlier worker, but nothing else
+        if (stat(address.path.c_str(), &existing) == 0 &&
+                S_ISSOCK(existing.st_mode))
+        {
+            unlink(address.path.c_str());
+        }
+        fd = openUnixSocket(address.path, addr);
+        if (bind(fd, (sockaddr*) &addr, sizeof(addr)) != 0 ||
+                listen(fd, 16) != 0)
+        {
+            std::string failure = systemError("can't listen on " + address.path);
+            close(fd);
+            throw remoteError(failure);
+        }
+        return(fd);
+    }
+    struct addrinfo hints;
+    struct addrinfo* candidates;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    // An empty host or * listens on every interface
+    const bool anyHost = (address.host.empty() || address.host == "*");
+    int status = getaddrinfo((anyHost ? NULL : address.host.c_str()),
+                             address.port.c_str(), &hints, &candidates);
+    if (status != 0)
+    {
+        throw remoteError(std::string("address lookup failed: ") +
+                          gai_strerror(status));
+    }
+    std::string failure = "no usable address";
+    int on = 1;
+    fd = -1;
+    for (struct addrinfo* itr = candidates; itr != NULL; itr = itr -> ai_next)
+    {
+        fd = socket(itr -> ai_family, itr -> ai_socktype, itr -> ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, itr -> ai_addr, itr -> ai_addrlen) == 0 &&
+                listen(fd, 16) == 0)
+        {
+            break;
+        }
+        failure = systemError("can't listen on port " + address.port);
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(candidates);
+    if (fd < 0)
+    {
+        throw remoteError(failure);
+    }
+    return(fd);
+}
+#endif
+
+remoteConnection::remoteConnection(const std::string& addr,
+                                   const simulationModelData& data,
+                                   int random_seed)
+{
+    address = addr;
+    cores = 0;
+    fd = -1;
+#ifdef _WIN32
+    throw remoteError("remote workers are not supported on Windows");
+#else
+    const socketAddress target = parseAddress(address);
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(REMOTE_CONNECT_TIMEOUT_MS);
+    std::string failure;
+    // The worker may still be starting up
+    while ((fd = tryConnect(target, failure)) < 0)
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            throw remoteError(failure);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(REMOTE_POLL_MS));
+    }
+    try
+    {
+        messageWriter hello;
+        hello.put((int) REMOTE_PROTOCOL_VERSION);
+        hello.put(BYTE_ORDER_MARK);
+        hello.put(random_seed);
+        writeModelData(hello, data);
+        sendFrame(fd, frame_hello, hello);
+        if (!waitReadable(fd, REMOTE_CONNECT_TIMEOUT_MS))
+        {
+            throw remoteError("no reply from worker");
+        }
+        std::vector<char> body;
+        if (recvFrame(fd, body) != frame_ready)
+        {
+            throw remoteError("unexpected reply from worker");
+        }
+        messageReader ready(body);
+        ready.get(cores);
+        if (cores < 1)
+        {
+            throw remoteError("worker has no threads");
+        }
+    }
+    catch (...)
+    {
+        close(fd);
+        fd = -1;
+        throw;
+    }
+#endif
+}
+
+remoteConnection::~remoteConnection()
+{
+#ifndef _WIN32
+    if (fd >= 0)
+    {
+        try
+        {
+            sendFrame(fd, frame_bye, messageWriter());
+        }
+        catch (const remoteError&)
+        {
+            // pass
+        }
+        close(fd);
+    }
+#endif
+}
+
+bool remoteConnection::simulate(taskKind kind,
+                                const captureSpecification& capture,
+                                const Eigen::MatrixXd& params,
+                                Eigen::MatrixXd& results,
+                                std::vector<simulationResultSet>& result_sets,
+                                const std::atomic<bool>& cancel_token)
+{
+#ifdef _WIN32
+    throw remoteError("remote workers are not supported on Windows");
+#else
+    messageWriter batch;
+    batch.put((int) kind);
+    writeCapture(batch, capture);
+    batch.put(params);
+    sendFrame(fd, frame_batch, batch);
+
+    // The worker always answers a batch, even a cancelled one, so that
+    // replies stay matched to batches. A worker which doesn't answer a
+    // cancel in time is taken to be gone, so that the claimed tasks are
+    // handed back rather than waited on for good.
+    bool cancelSent = false;
+    std::chrono::steady_clock::time_point deadline;
+    while (!waitReadable(fd, REMOTE_POLL_MS))
+    {
+        if (!cancelSent && cancel_token)
+        {
+            sendFrame(fd, frame_cancel, messageWriter());
+            cancelSent = true;
+            deadline = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(REMOTE_CANCEL_TIMEOUT_MS);
+        }
+        else if (cancelSent && std::chrono::steady_clock::now() > deadline)
+        {
+            throw remoteError("no reply to cancellation");
+        }
+    }
+    std::vector<char> body;
+    if (recvFrame(fd, body) != frame_results)
+    {
+        throw remoteError("unexpected reply from worker");
+    }
+    messageReader in(body);
+    bool completed;
+    in.get(completed);
+    if (!completed)
+    {
+        return(false);
+    }
+    in.get(results);
+    if (results.rows() != params.rows())
+    {
+        throw remoteError("worker returned the wrong number of results");
+    }
+    if (kind == sim_result_task)
+    {
+        result_sets.resize(in.getSize());
+        for (unsigned int i = 0; i < result_sets.size(); i++)
+        {
+            readResultSet(in, result_sets[i]);
+        }
+        if ((int) result_sets.size() != params.rows())
+        {
+            throw remoteError("worker returned the wrong number of results");
+        }
+    }
+    return(true);
+#endif
+}
+
+remoteProxy::remoteProxy(NodePool* pl, int slt,
+                         std::unique_ptr<remoteConnection> conn)
+    : pool(pl), slot(slt), connection(std::move(conn)), victim_generator(slt)
+{
+    alive = true;
+    stop = false;
+    thread = std::thread(&remoteProxy::run, this);
+}
+
+remoteProxy::~remoteProxy()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stop = true;
+        wakeup.notify_all();
+    }
+    thread.join();
+}
+
+int remoteProxy::weight()
+{
+    return(alive ? connection -> cores : 0);
+}
+
+void remoteProxy::notify()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    wakeup.notify_all();
+}
+
+void remoteProxy::run()
+{
+    const int batchSize = REMOTE_TASKS_PER_CORE*(connection -> cores);
+    std::vector<int> claimed;
+    Eigen::MatrixXd params;
+    Eigen::MatrixXd results;
+    std::vector<simulationResultSet> result_sets;
+    int chunkStart, chunkSize, i;
+    taskKind kind;
+    bool completed;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stop && !(pool -> blockAvailable()))
+            {
+                wakeup.wait(lock);
+            }
+            if (stop)
+            {
+                return;
+            }
+        }
+        // Claim chunks as a local worker would, until the batch is full
+        claimed.clear();
+        while ((int) claimed.size() < batchSize &&
+                pool -> claimChunk(slot, victim_generator, chunkStart, chunkSize))
+        {
+            for (i = chunkStart; i < chunkStart + chunkSize; i++)
+            {
+                claimed.push_back(pool -> blockParticle(i));
+            }
+        }
+        if (claimed.empty())
+        {
+            continue;
+        }
+        // The block can't change until the claimed tasks are completed
+        kind = pool -> block_kind;
+        params.resize(claimed.size(), (pool -> block_params) -> cols());
+        for (i = 0; i < (int) claimed.size(); i++)
+        {
+            params.row(i) = (pool -> block_params) -> row(claimed[i]);
+        }
+        try
+        {
+            completed = connection -> simulate(kind, *(pool -> capture), params,
+                                               results, result_sets,
+                                               pool -> cancelled);
+        }
+        catch (const std::exception& err)
+        {
+            alive = false;
+            log_ring.push(log_warning, "Remote worker " + 
+                    (connection -> address) + " failed (" + err.what() + 
+                    "); continuing with local workers.");
+            requeue(claimed);
+            return;
+        }
+        if (completed && !(pool -> cancelled))
+        {
+            for (i = 0; i < (int) claimed.size(); i++)
+            {
+                (*(pool -> result_pointer)).row(claimed[i]) = results.row(i);
+                if (kind == sim_result_task)
+                {
+                    (*(pool -> result_complete_pointer))[claimed[i]] =
+                        std::move(result_sets[i]);
+                }
+                pool -> finishTask(claimed[i]);
+            }
+        }
+        pool -> completeTasks((int) claimed.size());
+    }
+}
+
+void remoteProxy::requeue(const std::vector<int>& claimed)
+{
+    for (unsigned int i = 0; i < claimed.size(); i++)
+    {
+        const instruction task = pool -> blockTask(claimed[i]);
+        while (!(pool -> tasks).push(task))
+        {
+            std::this_thread::yield();
+        }
+    }
+    pool -> backend -> notify(pool);
+}
+
+#ifndef _WIN32
+/** Wait for the next frame from a client, returning false if the user
+ * interrupts first*/
+static bool awaitFrame(int fd)
+{
+    while (!waitReadable(fd, REMOTE_POLL_MS))
+    {
+        if (pendingInterrupt())
+        {
+            return(false);
+        }
+    }
+    return(true);
+}
+
+/** Simulate every row of params on pool, abandoning the batch if the
+ * client cancels it. interrupted is set if the user interrupts the
+ * worker. Returns whether every result was written.*/
+static bool runBatch(int fd, NodePool& pool, taskKind kind,
+                     const Eigen::MatrixXd& params, bool& interrupted)
+{
+    const int blockSize = pool.linearPredictorBlockSize();
+    std::vector<char> body;
+    bool completed = true;
+    int first, count;
+    for (first = 0; completed && first < params.rows(); first += count)
+    {
+        count = std::min(blockSize, (int) params.rows() - first);
+        blockFuture block = pool.submitBlock(kind, &params, first, count);
+        while (!block.ready())
+        {
+            if (waitReadable(fd, REMOTE_POLL_MS))
+            {
+                if (recvFrame(fd, body) != frame_cancel)
+                {
+                    throw remoteError("unexpected message during a batch");
+                }
+                pool.cancel();
+            }
+            else if (!interrupted && pendingInterrupt())
+            {
+                interrupted = true;
+                pool.cancel();
+            }
+        }
+        completed = block.wait() && !interrupted;
+    }
+    return(completed);
+}
+
+/** Serve one client until it disconnects, adding the particles of its
+ * completed batches to simulated. Returns false if the user interrupted
+ * the worker.*/
+static bool serveClient(int fd, int cores, double& simulated)
+{
+    std::vector<char> body;
+    int version, seed, kind;
+    std::uint32_t byteOrder;
+    if (!awaitFrame(fd))
+    {
+        return(false);
+    }
+    if (recvFrame(fd, body) != frame_hello)
+    {
+        throw remoteError("expected a handshake");
+    }
+    messageReader hello(body);
+    hello.get(version);
+    hello.get(byteOrder);
+    if (version != REMOTE_PROTOCOL_VERSION || byteOrder != BYTE_ORDER_MARK)
+    {
+        sendError(fd, "worker and client have different protocol versions "
+                      "or byte orders");
+        throw remoteError("client has a different protocol version or byte order");
+    }
+    hello.get(seed);
+    std::shared_ptr<simulationModelData> data =
+        std::make_shared<simulationModelData>();
+    readModelData(hello, *data);
+    std::shared_ptr<captureSpecification> capture =
+        std::make_shared<captureSpecification>();
+    capture -> active = false;
+
+    Eigen::MatrixXd params;
+    Eigen::MatrixXd results;
+    std::vector<simulationResultSet> result_sets;
+    NodePool pool(&results, &result_sets, cores, seed, data, capture,
+                  false, 0, backend_threads, std::vector<std::string>());
+    messageWriter ready;
+    ready.put(cores);
+    sendFrame(fd, frame_ready, ready);
+
+    bool completed, interrupted = false;
+    frameType type;
+    while (!interrupted)
+    {
+        if (!awaitFrame(fd))
+        {
+            return(false);
+        }
+        type = recvFrame(fd, body);
+        if (type == frame_bye)
+        {
+            return(true);
+        }
+        if (type == frame_cancel)
+        {
+            // The batch it cancels has already been answered
+            continue;
+        }
+        if (type != frame_batch)
+        {
+            throw remoteError("unexpected message from client");
+        }
+        pool.fitCostModel(params);
+        messageReader batch(body);
+        batch.get(kind);
+        if (kind != sim_task && kind != sim_result_task)
+        {
+            throw remoteError("invalid task kind in batch");
+        }
+        readCapture(batch, *capture);
+        batch.get(params);
+        results.resize(params.rows(), data -> m);
+        result_sets.clear();
+        if (kind == sim_result_task)
+        {
+            result_sets.resize(params.rows());
+        }
+        pool.resetCompletion(params.rows());
+        completed = runBatch(fd, pool, (taskKind) kind, params, interrupted);
+        if (completed)
+        {
+            simulated += params.rows();
+        }
+
+        messageWriter reply;
+        reply.put(completed);
+        if (completed)
+        {
+            reply.put(results);
+            if (kind == sim_result_task)
+            {
+                reply.put((std::int64_t) result_sets.size());
+                for (unsigned int i = 0; i < result_sets.size(); i++)
+                {
+                    writeResultSet(reply, result_sets[i]);
+                }
+            }
+        }
+        sendFrame(fd, frame_results, reply);
+    }
+    return(false);
+}
+#endif
+
+double serveSimulations(const std::string& address, int cores, bool once)
+{
+#ifdef _WIN32
+    Rcpp::stop("Simulation workers are not supported on Windows.");
+    return(0.0);
+#else
+    socketAddress target;
+    int listener, client;
+    bool interrupted = false;
+    double simulated = 0.0;
+    try
+    {
+        target = parseAddress(address);
+        listener = openListener(target);
+    }
+    catch (const remoteError& err)
+    {
+        Rcpp::stop(err.what());
+    }
+    Rcpp::Rcout << "Simulation worker listening on " << address << " with "
+                << cores << " thread(s)" << std::endl;
+    while (!interrupted)
+    {
+        if (!awaitFrame(listener))
+        {
+            interrupted = true;
+            break;
+        }
+        client = accept(listener, NULL, NULL);
+        if (client < 0)
+        {
+            continue;
+        }
+        configureSocket(client, !target.local);
+        try
+        {
+            interrupted = !serveClient(client, cores, simulated);
+        }
+        catch (const remoteError& err)
+        {
+            Rcpp::Rcout << "Client disconnected: " << err.what() << "\n";
+        }
+        catch (const std::bad_alloc&)
+        {
+            Rcpp::Rcout << "Client disconnected: out of memory\n";
+        }
+        catch (...)
+        {
+            close(client);
+            close(listener);
+            throw;
+        }
+        close(client);
+        if (once)
+        {
+            break;
+        }
+    }
+    close(listener);
+    if (target.local)
+    {
+        unlink(target.path.c_str());
+    }
+    if (interrupted)
+    {
+        throw Rcpp::internal::InterruptedException();
+    }
+    return(simulated);
+#endif
+}
+
+// [[Rcpp::export]]
+double run_simulation_worker(std::string address, int cores, bool once)
+{
+    if (cores < 1)
+    {
+        Rcpp::stop("n_cores must be at least 1.");
+    }
+    return(serveSimulations(address, cores, once));
+}
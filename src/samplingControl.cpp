@@ -10,10 +10,10 @@ samplingControl::samplingControl(SEXP integerParameters,
     Rcpp::IntegerVector inIntegerParams(integerParameters);
     Rcpp::NumericVector inNumericParams(numericParameters);
 
-    if (inIntegerParams.size() != 10 ||
-        inNumericParams.size() != 3)
+    if (inIntegerParams.size() != 16 ||
+        inNumericParams.size() != 5)
     {
-        Rcpp::stop("Exactly 14 samplingControl parameters are required.");
+        Rcpp::stop("Exactly 21 samplingControl parameters are required.");
     }
 
     simulation_width = inIntegerParams(0);
@@ -26,17 +26,28 @@ samplingControl::samplingControl(SEXP integerParameters,
     max_batches = inIntegerParams(7);
     multivariatePerturbation = inIntegerParams(8) != 0;
     m = inIntegerParams(9);
-#ifdef SPATIALSEIR_SINGLETHREAD
-    if (CPU_cores > 1)
+    capture_replicates = inIntegerParams(10) != 0;
+    compress_compartments = inIntegerParams(11) != 0;
+    pin_workers = inIntegerParams(12) != 0;
+    spin_wait_us = inIntegerParams(13);
+    auto_tune = inIntegerParams(14) != 0;
+    backend = (backendKind) inIntegerParams(15);
+    if (!executionBackend::available(backend))
     {
-        Rcpp::stop("Error: multiple cores requested for ABSEIR compiled in single thread mode");
+        Rcpp::stop("Error: the requested execution backend is not available in this build of ABSEIR");
+    }
+    if (backend == backend_serial && CPU_cores > 1)
+    {
+        Rcpp::stop("Error: multiple cores requested with the serial execution backend");
     }
-#endif
 
 
     accept_fraction = inNumericParams(0);
     shrinkage = inNumericParams(1);
     target_eps = inNumericParams(2);
+    target_batch_seconds = inNumericParams(3);
+    weight_tolerance = inNumericParams(4);
+    tuned_simulation_seconds = 0.0;
 
     if (algorithm != ALG_BasicABC && 
         algorithm != ALG_ModifiedBeaumont2009 && 
@@ -49,6 +60,18 @@ samplingControl::samplingControl(SEXP integerParameters,
     {
         Rcpp::stop("max_batches must be greater than zero.");
     }
+    if (auto_tune && !(target_batch_seconds > 0))
+    {
+        Rcpp::stop("target_batch_seconds must be greater than zero.");
+    }
+    if (!(weight_tolerance >= 0 && weight_tolerance < 1))
+    {
+        Rcpp::stop("weight_tolerance must be at least zero and less than one.");
+    }
+    if (!auto_tune && CPU_cores <= 0)
+    {
+        Rcpp::stop("CPU_cores must be greater than zero unless auto tuning.");
+    }
 }
 
 void samplingControl::summary()
@@ -65,9 +88,18 @@ void samplingControl::summary()
     Rcpp::Rcout << "    max_batches: " << max_batches << "\n";
     Rcpp::Rcout << "    multivariatePerturbation: " << multivariatePerturbation << "\n";
     Rcpp::Rcout << "    m: " << m << "\n";
+    Rcpp::Rcout << "    capture_replicates: " << capture_replicates << "\n";
+    Rcpp::Rcout << "    compress_compartments: " << compress_compartments << "\n";
+    Rcpp::Rcout << "    pin_workers: " << pin_workers << "\n";
+    Rcpp::Rcout << "    spin_wait_us: " << spin_wait_us << "\n";
+    Rcpp::Rcout << "    remote_workers: " << remote_workers.size() << "\n";
+    Rcpp::Rcout << "    backend: " << backend << "\n";
+    Rcpp::Rcout << "    auto_tune: " << auto_tune << "\n";
+    Rcpp::Rcout << "    target_batch_seconds: " << target_batch_seconds << "\n";
     Rcpp::Rcout << "    accept_fraction: " << accept_fraction << "\n";
     Rcpp::Rcout << "    shrinkage: " << shrinkage << "\n";
     Rcpp::Rcout << "    target_eps: " << target_eps << "\n";
+    Rcpp::Rcout << "    weight_tolerance: " << weight_tolerance << "\n";
     Rcpp::Rcout << "    Note: not all parameters are used for all algorithms.\n\n";
 
 
@@ -89,6 +121,23 @@ samplingControl::~samplingControl()
     }
 }
 
+void samplingControl::setRemoteWorkers(SEXP addresses)
+{
+    remote_workers = Rcpp::as<std::vector<std::string> >(addresses);
+}
+
+Rcpp::List samplingControl::getTuning()
+{
+    Rcpp::List outList;
+    outList["n_cores"] = CPU_cores;
+    outList["batch_size"] = batch_size;
+    outList["init_batch_size"] = init_batch_size;
+    outList["simulation_seconds"] = tuned_simulation_seconds;
+    outList["calibration_cores"] = Rcpp::wrap(tuned_cores);
+    outList["calibration_throughput"] = Rcpp::wrap(tuned_throughput);
+    return(outList);
+}
+
 int samplingControl::getModelComponentType()
 {
     return(LSS_SAMPLING_CONTROL_MODEL_TYPE);
@@ -98,7 +147,9 @@ RCPP_MODULE(mod_samplingControl)
 {
     using namespace Rcpp;
     class_<samplingControl>( "samplingControl" )
-    .constructor<SEXP, SEXP>();
+    .constructor<SEXP, SEXP>()
+    .method("setRemoteWorkers", &samplingControl::setRemoteWorkers)
+    .method("getTuning", &samplingControl::getTuning);
 }
 
 
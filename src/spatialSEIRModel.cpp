@@ -2,6 +2,7 @@
 #include <Eigen/Core>
 #include <RcppEigen.h>
 #include <cmath>
+#include <algorithm>
 #include <math.h>
 #include <spatialSEIRModel.hpp>
 #include <dataModel.hpp>
@@ -173,41 +174,63 @@ spatialSEIRModel::spatialSEIRModel(dataModel& dataModel_,
     parameterL = Eigen::MatrixXd::Zero(nParams, nParams);
     parameterICovDet = 0.0;
 
-    result_idx = std::vector<int>();
+    pending_kind = sim_task;
+    pending_next = 0;
+
+    // Record everything until told otherwise
+    capture = std::make_shared<captureSpecification>();
+    capture -> active = false;
+
+    // Model data is copied once and shared read-only by all workers
+    std::shared_ptr<simulationModelData> modelData = 
+        std::make_shared<simulationModelData>();
+    modelData -> S0 = initialValueContainerInstance -> S0;
+    modelData -> E0 = initialValueContainerInstance -> E0;
+    modelData -> I0 = initialValueContainerInstance -> I0;
+    modelData -> R0 = initialValueContainerInstance -> R0;
+    modelData -> offset = exposureModelInstance -> offset;
+    modelData -> Y = dataModelInstance -> Y;
+    modelData -> na_mask = dataModelInstance -> na_mask;
+    modelData -> dataModelType = dataModelInstance -> dataModelType;
+    modelData -> DM_vec = distanceModelInstance -> dm_list;
+    modelData -> TDM_vec = distanceModelInstance -> tdm_list;
+    modelData -> TDM_empty = distanceModelInstance -> tdm_empty;
+    modelData -> X = exposureModelInstance -> X;
+    modelData -> X_rs = reinfectionModelInstance -> X_rs;
+    modelData -> transitionMode = transitionPriorsInstance -> mode;
+    modelData -> E_to_I_prior = transitionPriorsInstance -> E_to_I_params;
+    modelData -> I_to_R_prior = transitionPriorsInstance -> I_to_R_params;
+    modelData -> inf_mean = transitionPriorsInstance -> inf_mean;
+    modelData -> spatial_prior = distanceModelInstance -> spatial_prior;
+    modelData -> exposure_precision = exposureModelInstance -> betaPriorPrecision;
+    modelData -> reinfection_precision = reinfectionModelInstance -> betaPriorPrecision;
+    modelData -> exposure_mean = exposureModelInstance -> betaPriorMean;
+    modelData -> reinfection_mean = reinfectionModelInstance -> betaPriorMean;
+    modelData -> phi = dataModelInstance -> phi;
+    modelData -> data_compartment = dataModelInstance -> dataModelCompartment;
+    modelData -> cumulative = dataModelInstance -> cumulative;
+    modelData -> m = samplingControlInstance -> m;
+    modelData -> capture_replicates = samplingControlInstance -> capture_replicates;
+    modelData -> compress_compartments = samplingControlInstance -> compress_compartments;
+
+    if (samplingControlInstance -> auto_tune && 
+            samplingControlInstance -> algorithm != ALG_Simulate)
+    {
+        autoTune(modelData);
+    }
 
     // Create the worker pool
     worker_pool = std::unique_ptr<NodePool>(
                 new NodePool(&results_double,
                      &results_complete,
-                     &result_idx,
                      (unsigned int) samplingControlInstance -> CPU_cores,
                      samplingControlInstance->random_seed,
-                     initialValueContainerInstance -> S0,
-                     initialValueContainerInstance -> E0,
-                     initialValueContainerInstance -> I0,
-                     initialValueContainerInstance -> R0,
-                     exposureModelInstance -> offset,
-                     dataModelInstance -> Y,
-                     dataModelInstance -> na_mask,
-                     dataModelInstance -> dataModelType,
-                     distanceModelInstance -> dm_list,
-                     distanceModelInstance -> tdm_list,
-                     distanceModelInstance -> tdm_empty,
-                     exposureModelInstance -> X,
-                     reinfectionModelInstance -> X_rs,
-                     transitionPriorsInstance -> mode,
-                     transitionPriorsInstance -> E_to_I_params,
-                     transitionPriorsInstance -> I_to_R_params,
-                     transitionPriorsInstance -> inf_mean,
-                     distanceModelInstance -> spatial_prior,
-                     exposureModelInstance -> betaPriorPrecision,
-                     reinfectionModelInstance -> betaPriorPrecision, 
-                     exposureModelInstance -> betaPriorMean,
-                     reinfectionModelInstance -> betaPriorMean,
-                     dataModelInstance -> phi,
-                     dataModelInstance -> dataModelCompartment,
-                     dataModelInstance -> cumulative,
-                     samplingControlInstance -> m
+                     modelData,
+                     capture,
+                     samplingControlInstance -> pin_workers,
+                     samplingControlInstance -> spin_wait_us,
+                     samplingControlInstance -> backend,
+                     samplingControlInstance -> remote_workers
                 ));
 }
 
@@ -380,6 +403,23 @@ Rcpp::List spatialSEIRModel::sample(SEXP nSample, SEXP returnComps, SEXP verbose
     }
 
     std::string sim_type_atom = (R ? sim_result_atom : sim_atom);
+
+    // Tuned batch sizes were chosen without knowing the number of samples
+    if (samplingControlInstance -> auto_tune)
+    {
+        if (samplingControlInstance -> algorithm == ALG_DelMoral2012)
+        {
+            samplingControlInstance -> batch_size = N;
+            samplingControlInstance -> init_batch_size = N;
+        }
+        else
+        {
+            samplingControlInstance -> batch_size = 
+                std::max(samplingControlInstance -> batch_size, N);
+            samplingControlInstance -> init_batch_size = 
+                std::max(samplingControlInstance -> init_batch_size, N);
+        }
+    }
     
     if (samplingControlInstance -> algorithm == ALG_BasicABC)
     {
@@ -407,6 +447,54 @@ Rcpp::List spatialSEIRModel::sample(SEXP nSample, SEXP returnComps, SEXP verbose
     }
 }
 
+void spatialSEIRModel::setCaptureSpecification(SEXP compartments,
+                                               SEXP locationMap,
+                                               SEXP timeWindow)
+{
+    Rcpp::IntegerVector inCompartments(compartments);
+    Rcpp::IntegerVector inLocationMap(locationMap);
+    Rcpp::IntegerVector inTimeWindow(timeWindow);
+    const int nLoc = (dataModelInstance -> Y).cols();
+    const int nTpt = (dataModelInstance -> Y).rows();
+    int i;
+
+    if (inLocationMap.size() != nLoc)
+    {
+        Rcpp::stop("Capture location map must have one entry per location.");
+    }
+    if (inTimeWindow.size() != 2 || inTimeWindow(0) < 0 || 
+            inTimeWindow(1) > nTpt || inTimeWindow(0) >= inTimeWindow(1))
+    {
+        Rcpp::stop("Capture time window must satisfy 0 <= start < end <= nTpt.");
+    }
+
+    captureSpecification newCapture;
+    newCapture.active = true;
+    newCapture.nColumns = 0;
+    for (i = 0; i < inCompartments.size(); i++)
+    {
+        if (inCompartments(i) < 0 || inCompartments(i) > 7)
+        {
+            Rcpp::stop("Capture compartments must be indices between 0 and 7.");
+        }
+        newCapture.compartments.push_back(inCompartments(i));
+    }
+    for (i = 0; i < nLoc; i++)
+    {
+        newCapture.location_map.push_back(inLocationMap(i));
+        newCapture.nColumns = std::max(newCapture.nColumns, inLocationMap(i) + 1);
+    }
+    if (newCapture.nColumns == 0)
+    {
+        Rcpp::stop("Capture specification must include at least one location.");
+    }
+    newCapture.time_start = inTimeWindow(0);
+    newCapture.time_end = inTimeWindow(1);
+    // Simulations abandoned by an earlier sampler may still read the spec
+    pending_block.wait();
+    *capture = newCapture;
+}
+
 bool spatialSEIRModel::setParameters(Eigen::MatrixXd params, 
         Eigen::VectorXd weights, Eigen::MatrixXd results, double eps)
 {
@@ -539,14 +627,206 @@ void spatialSEIRModel::run_simulations(Eigen::MatrixXd params,
                                        Eigen::MatrixXd* results_dest,
                                        std::vector<simulationResultSet>* results_c_dest)
 {
-    int i;
+    begin_simulations(params, sim_type_atom, results_dest, results_c_dest);
+    finish_simulations();
+}
+
+void spatialSEIRModel::begin_simulations(Eigen::MatrixXd params, 
+                                         std::string sim_type_atom,
+                                         Eigen::MatrixXd* results_dest,
+                                         std::vector<simulationResultSet>* results_c_dest)
+{
+    // The workers may still be reading an abandoned batch
+    pending_block.wait();
+    // Runtimes of the last batch refine the ordering of the next
+    worker_pool -> fitCostModel(pending_params);
+    pending_params = params;
+    pending_kind = (sim_type_atom == sim_result_atom ? 
+                    sim_result_task : sim_task);
+    // Full results go to a preallocated slot per particle
+    if (pending_kind == sim_result_task)
+    {
+        results_c_dest -> clear();
+        results_c_dest -> resize(pending_params.rows());
+    }
+    worker_pool -> resetCompletion(pending_params.rows());
     worker_pool -> setResultsDest(results_dest, 
                                   results_c_dest);
-    for (i = 0; i < params.rows(); i++)
+    // Particles are submitted a block at a time; the block size bounds the
+    // memory used for their linear predictors.
+    pending_next = 0;
+    submit_next_block();
+}
+
+void spatialSEIRModel::finish_simulations()
+{
+    bool completed = pending_block.wait();
+    while (completed && pending_next < pending_params.rows())
+    {
+        submit_next_block();
+        completed = pending_block.wait();
+    }
+    if (!completed)
+    {
+        raise_interrupt();
+    }
+}
+
+void spatialSEIRModel::await_simulation(int idx)
+{
+    bool completed = true;
+    while (completed && idx >= pending_next && 
+            pending_next < pending_params.rows())
+    {
+        completed = pending_block.wait();
+        if (completed)
+        {
+            submit_next_block();
+        }
+    }
+    if (!(completed && worker_pool -> awaitTask(idx)))
+    {
+        raise_interrupt();
+    }
+}
+
+void spatialSEIRModel::cancel_simulations()
+{
+    // Running simulations stop at their next cancellation check. Wait for
+    // them, so that none writes to the result buffers once the caller
+    // owns them again.
+    worker_pool -> cancel();
+    pending_next = pending_params.rows();
+    pending_block.wait();
+}
+
+void spatialSEIRModel::submit_next_block()
+{
+    const int blockSize = worker_pool -> linearPredictorBlockSize();
+    const int count = std::min(blockSize, (int) pending_params.rows() - pending_next);
+    pending_block = worker_pool -> submitBlock(pending_kind, &pending_params,
+                                               pending_next, count);
+    pending_next += count;
+}
+
+void spatialSEIRModel::raise_interrupt()
+{
+    // The pool consumed the interrupt while polling for it, so pass it
+    // on to R. Results of this batch are incomplete, and the buffers they
+    // were bound for may not outlive the running simulations.
+    pending_next = pending_params.rows();
+    pending_block.wait();
+    throw Rcpp::internal::InterruptedException();
+}
+
+// Replicate-captured compartments are stored as (nTpt, nLoc*m) matrices, 
+// whose column major layout is that of an R array with dim c(nTpt, nLoc, m).
+template <typename RVectorType, typename EigenMatrixType>
+static Rcpp::RObject wrapCompartment(const EigenMatrixType& values, 
+                                     int nLoc,
+                                     bool asReplicateArray)
+{
+    RVectorType out = Rcpp::wrap(values);
+    if (asReplicateArray)
+    {
+        out.attr("dim") = Rcpp::IntegerVector::create((int) values.rows(), 
+                                                      nLoc, 
+                                                      (int) values.cols()/nLoc);
+    }
+    return(out);
+}
+
+Rcpp::List spatialSEIRModel::wrapSimulationResult(const simulationResultSet& simResult)
+{
+    const bool hasReinfection = (reinfectionModelInstance -> 
+            betaPriorPrecision)(0) > 0;
+    const bool hasSpatial = (dataModelInstance -> Y).cols() > 1;
+    const bool asArray = samplingControlInstance -> capture_replicates;
+    // Under a capture specification, columns are the captured locations or
+    // regions, and rows the captured time window.
+    const int nLoc = (capture -> active ? capture -> nColumns : 
+                      (dataModelInstance -> Y).cols());
+    const int nTpt = (capture -> active ? capture -> time_end - capture -> time_start :
+                      (dataModelInstance -> Y).rows());
+    std::string transitionMode = transitionPriorsInstance -> mode;   
+
+    const char* names[8] = {"S", "E", "I", "R", 
+                            "S_star", "E_star", "I_star", "R_star"};
+    const Eigen::MatrixXi* compartments[8] = {
+        &simResult.S, &simResult.E, &simResult.I, &simResult.R,
+        &simResult.S_star, &simResult.E_star, &simResult.I_star, &simResult.R_star};
+    const std::vector<unsigned char>* codes[4] = {
+        &simResult.S_star_code, &simResult.E_star_code, 
+        &simResult.I_star_code, &simResult.R_star_code};
+    int i;
+
+    Rcpp::List subList;
+    if (samplingControlInstance -> compress_compartments)
+    {
+        // Transition counts only; S, E, I and R are reconstructed from these
+        // and the initial values when requested on the R side.  
+        const int nRep = (asArray ? samplingControlInstance -> m : 1);
+        Rcpp::List encoded;
+        for (i = 0; i < 4; i++)
+        {
+            if (!codes[i] -> empty())
+            {
+                encoded[names[i + 4]] = Rcpp::RawVector(codes[i] -> begin(), 
+                                                        codes[i] -> end());
+            }
+        }
+        subList["encoded"] = encoded;
+        subList["dims"] = (asArray ? Rcpp::IntegerVector::create(nTpt, nLoc, nRep) :
+                                     Rcpp::IntegerVector::create(nTpt, nLoc));
+        // Projected counts cannot be integrated back to compartment sizes
+        if (!(capture -> active))
+        {
+            Rcpp::List initialValues;
+            initialValues["S0"] = Rcpp::wrap(initialValueContainerInstance -> S0);
+            initialValues["E0"] = Rcpp::wrap(initialValueContainerInstance -> E0);
+            initialValues["I0"] = Rcpp::wrap(initialValueContainerInstance -> I0);
+            initialValues["R0"] = Rcpp::wrap(initialValueContainerInstance -> R0);
+            subList["initial_values"] = initialValues;
+        }
+    }
+    else
+    {
+        for (i = 0; i < 8; i++)
+        {
+            if (compartments[i] -> size() > 0)
+            {
+                subList[names[i]] = wrapCompartment<Rcpp::IntegerVector>(
+                        *compartments[i], nLoc, asArray);
+            }
+        }
+        if (simResult.p_se.size() > 0)
+        {
+            subList["p_se"] = wrapCompartment<Rcpp::NumericVector>(simResult.p_se, 
+                                                                  nLoc, asArray);
+            subList["X"] = Rcpp::wrap(simResult.X);
+        }
+    }
+    // We p_ei and p_ir not generally defined in non-exponential case.  
+    if (transitionMode == "exponential")
+    {
+        subList["p_ei"] = Rcpp::wrap(simResult.p_ei);
+        subList["p_ir"] = Rcpp::wrap(simResult.p_ir);
+    }
+    if (hasSpatial)
+    {
+        subList["rho"] = Rcpp::wrap(simResult.rho);
+    }
+    subList["beta"] = Rcpp::wrap(simResult.beta);
+    if (hasReinfection)
+    {
+        // TODO: output reinfection info
+    }
+    subList["result"] = Rcpp::wrap(simResult.result);
+    if (samplingControlInstance -> compress_compartments)
     {
-        worker_pool -> enqueue(sim_type_atom, i, params.row(i));
+        subList.attr("class") = "CompressedSimulationResult";
     }
-    worker_pool -> awaitFinished();
+    return(subList);
 }
 
 spatialSEIRModel::~spatialSEIRModel()
@@ -566,6 +846,7 @@ RCPP_MODULE(mod_spatialSEIRModel)
                  initialValueContainer&,
                  samplingControl&>()
     .method("sample", &spatialSEIRModel::sample)
-    .method("setParameters", &spatialSEIRModel::setParameters);
+    .method("setParameters", &spatialSEIRModel::setParameters)
+    .method("setCaptureSpecification", &spatialSEIRModel::setCaptureSpecification);
 }
 
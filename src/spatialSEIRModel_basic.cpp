@@ -3,6 +3,8 @@
 #include <RcppEigen.h>
 #include <cmath>
 #include <math.h>
+#include <algorithm>
+#include <utility>
 #include <spatialSEIRModel.hpp>
 #include <dataModel.hpp>
 #include <exposureModel.hpp>
@@ -17,8 +19,168 @@
 Rcpp::List spatialSEIRModel::sample_basic(int nSample, int verbose,
                                           std::string sim_type_atom)
 {
-    Rcpp::stop("Basic rejection algorithm not currently supported.\n");
-    // Return dummy value
+    const int nParams = param_matrix.cols();
+    const int m = samplingControlInstance -> m;
+    const int maxBatches = samplingControlInstance -> max_batches;
+    const double targetEps = samplingControlInstance -> target_eps;
+    const double acceptFraction = samplingControlInstance -> accept_fraction;
+    const bool keepCompartments = (sim_type_atom == sim_result_atom);
+    int i;
+
+    if (nSample <= 0)
+    {
+        Rcpp::stop("At least one sample must be requested.");
+    }
+    // With an acceptance fraction, stop after nSample/acceptFraction 
+    // simulations rather than at the end of the last batch.
+    const double maxSimulations = (acceptFraction > 0 ? 
+            std::max((double) nSample, std::ceil(nSample/acceptFraction)) :
+            std::numeric_limits<double>::infinity());
+
+    if (verbose > 1)
+    {
+        dataModelInstance -> summary();
+        exposureModelInstance -> summary();
+        transitionPriorsInstance -> summary();
+        reinfectionModelInstance -> summary();
+        distanceModelInstance -> summary();
+        initialValueContainerInstance -> summary();
+        samplingControlInstance -> summary();
+    }
+
+    // The best nSample particles seen so far occupy fixed slots, with a 
+    // max-heap of (distance, slot) giving the worst of them. Memory use 
+    // is bounded by nSample and the batch size, however many batches run.
+    param_matrix = Eigen::MatrixXd::Zero(nSample, nParams);
+    results_double = Eigen::MatrixXd::Zero(nSample, m);
+    results_complete = std::vector<simulationResultSet>();
+    if (keepCompartments)
+    {
+        results_complete.resize(nSample);
+    }
+    std::vector<std::pair<double, int> > accepted;
+    accepted.reserve(nSample);
+
+    auto done = [&](double nSimulated)
+    {
+        return((int) accepted.size() == nSample && 
+               ((targetEps > 0 && accepted.front().first <= targetEps) ||
+                nSimulated >= maxSimulations));
+    };
+
+    // Prior draws stream through the pool a batch at a time, the next 
+    // batch being drawn while the current one simulates.
+    Eigen::MatrixXd batch_params = 
+        generateParamsPrior(samplingControlInstance -> init_batch_size);
+    Eigen::MatrixXd next_params;
+    // Sized once for either batch size, so that it is never reallocated
+    // under simulations of an abandoned batch
+    Eigen::MatrixXd batch_results = Eigen::MatrixXd::Zero(std::max(
+                samplingControlInstance -> init_batch_size,
+                samplingControlInstance -> batch_size), m);
+    std::vector<simulationResultSet> batch_results_complete;
+    double nSimulated = 0.0;
+    int nBatches = 0;
+    bool terminate = false;
+    begin_simulations(batch_params, sim_type_atom, &batch_results, 
+                      &batch_results_complete);
+    while (!terminate)
+    {
+        const bool proposeNext = (nBatches + 1 < maxBatches);
+        if (proposeNext)
+        {
+            next_params = generateParamsPrior(samplingControlInstance -> batch_size);
+        }
+
+        const int batchRows = batch_params.rows();
+        for (i = 0; i < batchRows && !terminate; i++)
+        {
+            await_simulation(i);
+            nSimulated++;
+            // As for DelMoral2012, a particle is as close as its closest
+            // replicate
+            const double distance = batch_results.row(i).minCoeff();
+            int slot = -1;
+            if ((int) accepted.size() < nSample)
+            {
+                slot = accepted.size();
+                accepted.push_back(std::make_pair(distance, slot));
+                std::push_heap(accepted.begin(), accepted.end());
+            }
+            else if (distance < accepted.front().first)
+            {
+                std::pop_heap(accepted.begin(), accepted.end());
+                slot = accepted.back().second;
+                accepted.back().first = distance;
+                std::push_heap(accepted.begin(), accepted.end());
+            }
+            if (slot >= 0)
+            {
+                param_matrix.row(slot) = batch_params.row(i);
+                results_double.row(slot) = batch_results.row(i);
+                if (keepCompartments)
+                {
+                    results_complete[slot] = std::move(batch_results_complete[i]);
+                }
+            }
+            terminate = done(nSimulated);
+        }
+        if (i < batchRows)
+        {
+            cancel_simulations();
+        }
+        nBatches++;
+        if (verbose > 0 && !accepted.empty())
+        {
+            Rcpp::Rcout << "Batch " << nBatches << ": " << nSimulated << 
+                " simulated, eps: " << accepted.front().first << "\n";
+        }
+        terminate = terminate || !proposeNext;
+        if (!terminate)
+        {
+            batch_params.swap(next_params);
+            begin_simulations(batch_params, sim_type_atom, &batch_results, 
+                              &batch_results_complete);
+        }
+    }
+    // Abandoned simulations may still be running against the batch buffers
+    pending_block.wait();
+    if ((int) accepted.size() < nSample && verbose > 0)
+    {
+        Rcpp::Rcout << "Only " << accepted.size() << " of " << nSample 
+                    << " samples could be drawn\n";
+    }
+
+    // Return the accepted particles best first
+    std::sort(accepted.begin(), accepted.end());
+    const int nAccepted = accepted.size();
+    Eigen::MatrixXd out_params(nAccepted, nParams);
+    Eigen::MatrixXd out_results(nAccepted, m);
+    for (i = 0; i < nAccepted; i++)
+    {
+        out_params.row(i) = param_matrix.row(accepted[i].second);
+        out_results.row(i) = results_double.row(accepted[i].second);
+    }
+    param_matrix = out_params;
+    results_double = out_results;
+
     Rcpp::List outList;
+    if (keepCompartments)
+    {
+        Rcpp::List simulationResults; 
+        for (i = 0; i < nAccepted; i++)
+        {
+            simulationResults[std::to_string(i)] = 
+                wrapSimulationResult(results_complete[accepted[i].second]);
+        }
+        outList["simulationResults"] = simulationResults;
+    }
+    outList["result"] = Rcpp::wrap(results_double);
+    outList["params"] = Rcpp::wrap(param_matrix);
+    outList["completedEpochs"] = 1;
+    outList["weights"] = Rcpp::wrap(Eigen::VectorXd::Constant(nAccepted, 
+                1.0/std::max(1, nAccepted)));
+    outList["currentEps"] = (nAccepted > 0 ? accepted.back().first : 
+                             std::numeric_limits<double>::infinity());
     return(outList);
 }
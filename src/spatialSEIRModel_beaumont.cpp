@@ -13,21 +13,10 @@
 #include <samplingControl.hpp>
 #include <util.hpp>
 #include <SEIRSimNodes.hpp>
+#include <kernelDensityTree.hpp>
 
 
                                                                                 
-std::vector<size_t> sort_indexes(std::vector<int> inVec)
-{
-    vector<size_t> idx(inVec.size());
-    for (size_t i = 0; i < idx.size(); i++)
-    {
-        idx[i] = i;
-    }
-    std::sort(idx.begin(), idx.end(),
-         [&inVec](size_t i1, size_t i2){return(inVec[i1] < inVec[i2]);});
-    return(idx);    
-}
-
 std::vector<size_t> sort_indexes_eigen(Eigen::MatrixXd inMat)                     
 {                                                                               
         vector<size_t> idx(inMat.rows());                                           
@@ -68,7 +57,7 @@ void proposeParams_beaumont_multivariate(Eigen::MatrixXd* outParams,
     const int N = outParams -> rows();
     Eigen::MatrixXd curSamp = *outParams;
     Eigen::RowVectorXd parameterMeans = curSamp.colwise().mean();
-    auto parameterCentered = (curSamp.rowwise() - parameterMeans);
+    Eigen::MatrixXd parameterCentered = (curSamp.rowwise() - parameterMeans);
     Eigen::MatrixXd parameterCov = ((parameterCentered).transpose() 
             * (parameterCentered)/(N-1))*(std::sqrt(0.5));
     // Add a SD to overdisperse particles:
@@ -78,7 +67,10 @@ void proposeParams_beaumont_multivariate(Eigen::MatrixXd* outParams,
     //}
     Eigen::LLT<Eigen::MatrixXd> paramLLT = parameterCov.llt();
     auto L = Eigen::MatrixXd(paramLLT.matrixL());
-    auto parameterICov = paramLLT.solve(Eigen::MatrixXd::Identity(L.rows(), L.cols()));
+    // Evaluated here: the solve expression would refer to the temporary
+    // identity once this statement ends.
+    Eigen::MatrixXd parameterICov = paramLLT.solve(
+            Eigen::MatrixXd::Identity(L.rows(), L.cols()));
     auto parameterICovDet = 1.0/std::pow(L.diagonal().prod(), 2.0); 
     auto Z = Eigen::VectorXd(parameterCov.cols());
     //auto parameterICov = paramLLT.solve(Eigen::MatrixXd::Identity(L.rows(), L.cols()));
@@ -134,6 +126,31 @@ void proposeParams_beaumont_multivariate(Eigen::MatrixXd* outParams,
 }
 
 
+/** Proposal covariance which proposeParams_beaumont_multivariate records on
+ * the model. Batches are proposed one ahead of the simulations, so the 
+ * state is set aside in case the last proposed batch is not used.*/
+struct proposalCovariance
+{
+    Eigen::MatrixXd cov;
+    Eigen::MatrixXd icov;
+    Eigen::MatrixXd L;
+    double icovDet;
+    void save(spatialSEIRModel* model)
+    {
+        cov = model -> parameterCov;
+        icov = model -> parameterICov;
+        L = model -> parameterL;
+        icovDet = model -> parameterICovDet;
+    }
+    void restore(spatialSEIRModel* model)
+    {
+        model -> parameterCov = cov;
+        model -> parameterICov = icov;
+        model -> parameterL = L;
+        model -> parameterICovDet = icovDet;
+    }
+};
+
 void proposeParams_beaumont(Eigen::MatrixXd* outParams,
                             Eigen::MatrixXd* inParams,
                             Eigen::VectorXd* cum_weights,
@@ -184,6 +201,161 @@ void proposeParams_beaumont(Eigen::MatrixXd* outParams,
     }
 }
 
+bool beaumontLogKernel(const Eigen::MatrixXd& proposed,
+                       const Eigen::MatrixXd& previous,
+                       const Eigen::VectorXd& prev_weights,
+                       const Eigen::VectorXd& tau,
+                       const Eigen::MatrixXd& L,
+                       double tolerance,
+                       NodePool* pool,
+                       Eigen::VectorXd& logKernel)
+{
+    const int N = proposed.rows();
+    const int p = proposed.cols();
+    // Whitening both sets of particles by the perturbation kernel's scale 
+    // (its Cholesky factor, or the diagonal tau) turns each kernel exponent 
+    // into a Euclidean distance,
+    //   |z_i - z_j|^2 = |z_i|^2 + |z_j|^2 - 2 z_i.z_j,
+    // whose cross terms come from one GEMM per block of proposals.
+    // Centering first keeps the expansion from cancelling.
+    const Eigen::RowVectorXd center = previous.colwise().mean();
+    Eigen::MatrixXd zProposed, zPrevious;
+    double logNormalizer = -0.5*p*std::log(2.0*M_PI);
+    if (L.size() > 0)
+    {
+        zProposed = L.triangularView<Eigen::Lower>()
+            .solve((proposed.rowwise() - center).transpose());
+        zPrevious = L.triangularView<Eigen::Lower>()
+            .solve((previous.rowwise() - center).transpose());
+        logNormalizer -= L.diagonal().array().log().sum();
+    }
+    else
+    {
+        const Eigen::VectorXd tauInverse = tau.cwiseInverse();
+        zProposed = tauInverse.asDiagonal()*(proposed.rowwise() - center).transpose();
+        zPrevious = tauInverse.asDiagonal()*(previous.rowwise() - center).transpose();
+        logNormalizer -= tau.array().log().sum();
+    }
+    const Eigen::VectorXd previousTerm = prev_weights.array().log() 
+        - 0.5*zPrevious.colwise().squaredNorm().transpose().array();
+
+    logKernel.resize(N);
+    auto exactRows = [&](int first, int rows)
+    {
+        // One column per proposal, so that each reduction runs down
+        // contiguous memory
+        Eigen::MatrixXd logTerms(zPrevious.cols(), rows);
+        logTerms.noalias() = zPrevious.transpose()*zProposed.middleCols(first, rows);
+        logTerms.colwise() += previousTerm;
+        for (int r = 0; r < rows; r++)
+        {
+            // log-sum-exp, so that distant particles can't underflow the
+            // sum to zero
+            const double maxTerm = logTerms.col(r).maxCoeff();
+            logKernel(first + r) = maxTerm + std::log(
+                    (logTerms.col(r).array() - maxTerm).exp().sum()) 
+                - 0.5*zProposed.col(first + r).squaredNorm() + logNormalizer;
+        }
+    };
+    std::unique_ptr<kernelDensityTree> tree;
+    if (tolerance > 0)
+    {
+        tree = std::unique_ptr<kernelDensityTree>(new kernelDensityTree(
+                    zPrevious, prev_weights));
+    }
+    const int nBlocks = (N + BEAUMONT_WEIGHT_BLOCK_ROWS - 1)/
+        BEAUMONT_WEIGHT_BLOCK_ROWS;
+    const std::function<void(int)> block = [&](int b)
+    {
+        const int first = b*BEAUMONT_WEIGHT_BLOCK_ROWS;
+        const int rows = std::min(BEAUMONT_WEIGHT_BLOCK_ROWS, N - first);
+        if (!tree)
+        {
+            exactRows(first, rows);
+            return;
+        }
+        for (int r = first; r < first + rows; r++)
+        {
+            logKernel(r) = tree -> logKernelSum(zProposed.col(r), tolerance) 
+                + logNormalizer;
+            if (!std::isfinite(logKernel(r)))
+            {
+                exactRows(r, 1);
+            }
+        }
+    };
+    if (pool == nullptr)
+    {
+        for (int b = 0; b < nBlocks; b++)
+        {
+            block(b);
+        }
+        return(true);
+    }
+    return(pool -> parallelFor(nBlocks, block));
+}
+
+// [[Rcpp::export]]
+Eigen::VectorXd beaumont_log_kernel(Eigen::MatrixXd proposed,
+                                    Eigen::MatrixXd previous,
+                                    Eigen::VectorXd prev_weights,
+                                    Eigen::VectorXd tau,
+                                    Eigen::MatrixXd covariance,
+                                    double tolerance)
+{
+    Eigen::MatrixXd L;
+    if (covariance.size() > 0)
+    {
+        Eigen::LLT<Eigen::MatrixXd> covarianceLLT(covariance);
+        if (covarianceLLT.info() != Eigen::Success)
+        {
+            Rcpp::stop("covariance must be positive definite.");
+        }
+        L = covarianceLLT.matrixL();
+    }
+    Eigen::VectorXd logKernel;
+    beaumontLogKernel(proposed, previous, prev_weights, tau, L, tolerance,
+                      nullptr, logKernel);
+    return(logKernel);
+}
+
+Eigen::VectorXd spatialSEIRModel::beaumontWeights(const Eigen::MatrixXd& proposed,
+                                                  const Eigen::MatrixXd& previous,
+                                                  const Eigen::VectorXd& prev_weights,
+                                                  const Eigen::VectorXd& tau)
+{
+    const int N = proposed.rows();
+    int i;
+    const Eigen::MatrixXd noCholesky;
+    Eigen::VectorXd logKernel;
+    // Abandoned simulations must stop before the pool takes new work
+    pending_block.wait();
+    if (!beaumontLogKernel(proposed, previous, prev_weights, tau, 
+                (samplingControlInstance -> multivariatePerturbation ?
+                 parameterL : noCholesky), 
+                samplingControlInstance -> weight_tolerance,
+                worker_pool.get(), logKernel))
+    {
+        raise_interrupt();
+    }
+
+    Eigen::VectorXd logWeights(N);
+    for (i = 0; i < N; i++)
+    {
+        logWeights(i) = std::log(evalPrior(proposed.row(i))) - logKernel(i);
+    }
+    Eigen::VectorXd out = (logWeights.array() - logWeights.maxCoeff()).exp();
+    out /= out.sum();
+    for (i = 0; i < N; i++)
+    {
+        if (std::isnan(out(i)))
+        {
+            Rcpp::stop("nan weights encountered.");
+        }
+    }
+    return(out);
+}
+
 Rcpp::List spatialSEIRModel::sample_Beaumont2009(int nSample, int vb, 
                                                  std::string sim_type_atom)
 {
@@ -221,17 +393,29 @@ Rcpp::List spatialSEIRModel::sample_Beaumont2009(int nSample, int vb,
     const int Npart = nSample;
 
     const int maxBatches= samplingControlInstance -> max_batches;
-    const bool hasReinfection = (reinfectionModelInstance -> 
-               betaPriorPrecision)(0) > 0;
-    const bool hasSpatial = (dataModelInstance -> Y).cols() > 1;
-
-    std::string transitionMode = transitionPriorsInstance -> mode;   
-
     double e0 = std::numeric_limits<double>::infinity();
     double e1 = std::numeric_limits<double>::infinity();
     std::vector<size_t> reweight_idx;
+    Eigen::MatrixXd next_proposal_params;
+    proposalCovariance savedCovariance;
+    auto proposeBatch = [this](Eigen::MatrixXd* outParams,
+                               Eigen::MatrixXd* inParams,
+                               Eigen::VectorXd* cum_weights,
+                               Eigen::VectorXd* tau)
+    {
+        if (samplingControlInstance -> multivariatePerturbation)
+        {
+            proposeParams_beaumont_multivariate(outParams, inParams, 
+                    cum_weights, tau, generator, this);
+        }
+        else
+        {
+            proposeParams_beaumont(outParams, inParams, cum_weights, tau, 
+                    generator, this);
+        }
+    };
 
-    int i,j,k;
+    int i;
     int iteration;
 
     if (verbose > 1)
@@ -360,44 +544,36 @@ Rcpp::List spatialSEIRModel::sample_Beaumont2009(int nSample, int vb,
         }
 
 
-        // Propose params and run simulations
+        // Propose params and run simulations. Each batch after the first
+        // is proposed while the one before it simulates.
         int currentIdx = 0;
         int nBatches = 0;
+        if (maxBatches > 0)
+        {
+            proposeBatch(&preproposal_params, &param_matrix, &cum_weights, 
+                         &tau);
+            begin_simulations(preproposal_params,
+                              sim_atom,
+                              &preproposal_results, 
+                              &results_complete);
+        }
         while (currentIdx < Npart && 
                nBatches < maxBatches)
         {
-
-            // perturb parameters
-            if (samplingControlInstance -> multivariatePerturbation)
+            const bool proposeNext = (nBatches + 1 < maxBatches);
+            if (proposeNext)
             {
-                proposeParams_beaumont_multivariate(&preproposal_params, 
-                              &param_matrix,
-                              &cum_weights,
-                              &tau,
-                              generator,
-                              this);
+                savedCovariance.save(this);
+                next_proposal_params = preproposal_params;
+                proposeBatch(&next_proposal_params, &param_matrix, 
+                             &cum_weights, &tau);
             }
-            else
-            {
-                proposeParams_beaumont(&preproposal_params, 
-                              &param_matrix,
-                              &cum_weights,
-                              &tau,
-                              generator,
-                              this);     
-            }
-
 
-            // run simulations
-            run_simulations(preproposal_params,
-                            sim_atom,
-                            &preproposal_results, 
-                            &results_complete);
-
-
-           //std::vector<size_t> preproposal_order = sort_indexes_eigen(preproposal_results); 
+           // Results are tested in submission order as they arrive, and 
+           // the rest of the batch is abandoned once enough are accepted.
            for (i = 0; i < Nsim && currentIdx < Npart; i++)
            {
+               await_simulation(i);
                if (preproposal_results(i,0) < e1)
                {
                    proposed_param_matrix.row(currentIdx) = 
@@ -407,17 +583,32 @@ Rcpp::List spatialSEIRModel::sample_Beaumont2009(int nSample, int vb,
                    currentIdx++;
                }
            }
+           if (i < Nsim)
+           {
+               cancel_simulations();
+           }
            if (currentIdx < Npart && verbose > 1)
            {
                 Rcpp::Rcout << "  batch " << nBatches << ", " << currentIdx << 
                     "/" << Npart << " accepted\n";
            }
            nBatches ++;
+           if (currentIdx < Npart && nBatches < maxBatches)
+           {
+               preproposal_params.swap(next_proposal_params);
+               begin_simulations(preproposal_params,
+                                 sim_atom,
+                                 &preproposal_results, 
+                                 &results_complete);
+           }
+           else if (proposeNext)
+           {
+               savedCovariance.restore(this);
+           }
         }
 
         e0 = e1;
         w0 = w1;
-        double wtTot = 0.0;
         if (currentIdx + 1 < Npart)
         {
             if (verbose > 1)
@@ -432,62 +623,7 @@ Rcpp::List spatialSEIRModel::sample_Beaumont2009(int nSample, int vb,
         }
         else
         {
-            wtTot = 0.0;
-            double newWt, tmpWt;
-            double tmpWeightComp;
-            Eigen::VectorXd tmpParams;
-            if (samplingControlInstance -> multivariatePerturbation)
-            {
-                // Column vector of difference
-                tmpWeightComp = (-nParams/2.0)*std::log(2.0*3.14159) 
-                    - 0.5*std::log((parameterICovDet));
-                Eigen::MatrixXd a = Eigen::MatrixXd::Zero(param_matrix.cols(), 1);
-                for (i = 0; i < proposed_param_matrix.rows(); i++)
-                {
-                   newWt = 0.0; 
-                   for (j = 0; j < param_matrix.rows(); j++)
-                   {
-                       a.col(0) = (proposed_param_matrix.row(i) - 
-                                   param_matrix.row(j));
-                       newWt += w0(j)*std::exp(tmpWeightComp - 
-                               0.5*((a.transpose()*parameterICov*a)(0)));
-                   }
-
-                   w1(i) = evalPrior(proposed_param_matrix.row(i))/newWt;    
-                   if (std::isnan(w1(i)))
-                   {
-                       Rcpp::stop("nan weights encountered.");
-                   }
-                   wtTot += w1(i);
-                }
-                w1.array() /= wtTot;
-           }
-            else
-            {
-                for (i = 0; i < proposed_param_matrix.rows(); i++)
-                {
-                   newWt = 0.0; 
-                   tmpWt = 0.0;
-                   for (j = 0; j < param_matrix.rows(); j++)
-                   {
-                       tmpWt = 0.0;
-                       for (k = 0; k < proposed_param_matrix.cols(); k++)
-                       {
-                          tmpWt += R::dnorm(proposed_param_matrix(i,k),
-                                            param_matrix(j,k),
-                                            tau(k), 1);
-                       }
-                       newWt += w0(j)*std::exp(tmpWt);
-                   }
-                   w1(i) = evalPrior(proposed_param_matrix.row(i))/newWt;    
-                   if (std::isnan(w1(i)))
-                   {
-                       Rcpp::stop("nan weights encountered.");
-                   }
-                   wtTot += w1(i);
-                }
-                w1.array() /= wtTot;
-            }
+            w1 = beaumontWeights(proposed_param_matrix, param_matrix, w0, tau);
         }
 
         w0 = w1;
@@ -562,40 +698,21 @@ Rcpp::List spatialSEIRModel::sample_Beaumont2009(int nSample, int vb,
         int currentIdx = 0;
         int nBatches = 0;
         results_complete.clear();
+        proposeBatch(&preproposal_params, &param_matrix, &cum_weights, &tau);
+        begin_simulations(preproposal_params,
+                          sim_type_atom,
+                          &preproposal_results, 
+                          &proposed_results_complete);
         while (currentIdx < Npart)
         {
-            // perturb parameters
-            if (samplingControlInstance -> multivariatePerturbation)
-            {
-                proposeParams_beaumont_multivariate(&preproposal_params, 
-                              &param_matrix,
-                              &cum_weights,
-                              &tau,
-                              generator,
-                              this);
-            }
-            else
-            {
-                proposeParams_beaumont(&preproposal_params, 
-                              &param_matrix,
-                              &cum_weights,
-                              &tau,
-                              generator,
-                              this);     
-            }
-
-           proposed_results_complete.clear();
-           result_idx.clear();
+            savedCovariance.save(this);
+            next_proposal_params = preproposal_params;
+            proposeBatch(&next_proposal_params, &param_matrix, &cum_weights, 
+                         &tau);
 
-            // run simulations
-            run_simulations(preproposal_params,
-                            sim_type_atom,
-                            &preproposal_results, 
-                            &proposed_results_complete);
-
-           std::vector<size_t> result_order = sort_indexes(result_idx); 
            for (i = 0; i < Nsim && currentIdx < Npart; i++)
            {
+               await_simulation(i);
                if (preproposal_results(i,0) < e1)
                {
                    proposed_param_matrix.row(currentIdx) = 
@@ -603,22 +720,36 @@ Rcpp::List spatialSEIRModel::sample_Beaumont2009(int nSample, int vb,
                    proposed_results_double.row(currentIdx) = 
                        preproposal_results.row(i);
                    results_complete.push_back(
-                           proposed_results_complete[result_order[i]]);
+                           std::move(proposed_results_complete[i]));
                    currentIdx++;
                }
            }
+           if (i < Nsim)
+           {
+               cancel_simulations();
+           }
            if (currentIdx < Npart && verbose > 1)
            {
                 Rcpp::Rcout << "  batch " << nBatches << ", " << currentIdx << 
                     "/" << Npart << " accepted\n";
            }
            nBatches ++;
-           // Need to use indexes for results complete
+           if (currentIdx < Npart)
+           {
+               preproposal_params.swap(next_proposal_params);
+               begin_simulations(preproposal_params,
+                                 sim_type_atom,
+                                 &preproposal_results, 
+                                 &proposed_results_complete);
+           }
+           else
+           {
+               savedCovariance.restore(this);
+           }
         }
 
         e0 = e1;
         w0 = w1;
-        double wtTot = 0.0;
         if (currentIdx + 1 < Npart)
         {
             if (verbose > 1)
@@ -633,62 +764,7 @@ Rcpp::List spatialSEIRModel::sample_Beaumont2009(int nSample, int vb,
         }
         else
         {
-            wtTot = 0.0;
-            double newWt, tmpWt;
-            double tmpWeightComp;
-            Eigen::VectorXd tmpParams;
-            if (samplingControlInstance -> multivariatePerturbation)
-            {
-                // Column vector of difference
-                tmpWeightComp = (-nParams/2.0)*std::log(2.0*3.14159) 
-                    - 0.5*std::log((parameterICovDet));
-                Eigen::MatrixXd a = Eigen::MatrixXd::Zero(param_matrix.cols(), 1);
-                for (i = 0; i < proposed_param_matrix.rows(); i++)
-                {
-                   newWt = 0.0; 
-                   for (j = 0; j < param_matrix.rows(); j++)
-                   {
-                       a.col(0) = (proposed_param_matrix.row(i) - 
-                                   param_matrix.row(j));
-                       newWt += w0(j)*std::exp(tmpWeightComp - 
-                               0.5*((a.transpose()*parameterICov*a)(0)));
-                   }
-
-                   w1(i) = evalPrior(proposed_param_matrix.row(i))/newWt;    
-                   if (std::isnan(w1(i)))
-                   {
-                       Rcpp::stop("nan weights encountered.");
-                   }
-                   wtTot += w1(i);
-                }
-                w1.array() /= wtTot;
-           }
-            else
-            {
-                for (i = 0; i < proposed_param_matrix.rows(); i++)
-                {
-                   newWt = 0.0; 
-                   tmpWt = 0.0;
-                   for (j = 0; j < param_matrix.rows(); j++)
-                   {
-                       tmpWt = 0.0;
-                       for (k = 0; k < proposed_param_matrix.cols(); k++)
-                       {
-                          tmpWt += R::dnorm(proposed_param_matrix(i,k),
-                                            param_matrix(j,k),
-                                            tau(k), 1);
-                       }
-                       newWt += w0(j)*std::exp(tmpWt);
-                   }
-                   w1(i) = evalPrior(proposed_param_matrix.row(i))/newWt;    
-                   if (std::isnan(w1(i)))
-                   {
-                       Rcpp::stop("nan weights encountered.");
-                   }
-                   wtTot += w1(i);
-                }
-                w1.array() /= wtTot;
-            }
+            w1 = beaumontWeights(proposed_param_matrix, param_matrix, w0, tau);
         }
 
         w0 = w1;
@@ -700,35 +776,7 @@ Rcpp::List spatialSEIRModel::sample_Beaumont2009(int nSample, int vb,
         Rcpp::List simulationResults; 
         for (i = 0; i < (int) results_complete.size(); i++)
         {
-            Rcpp::List subList;
-            subList["S"] = Rcpp::wrap(results_complete[i].S);
-            subList["E"] = Rcpp::wrap(results_complete[i].E);
-            subList["I"] = Rcpp::wrap(results_complete[i].I);
-            subList["R"] = Rcpp::wrap(results_complete[i].R);
-
-            subList["S_star"] = Rcpp::wrap(results_complete[i].S_star);
-            subList["E_star"] = Rcpp::wrap(results_complete[i].E_star);
-            subList["I_star"] = Rcpp::wrap(results_complete[i].I_star);
-            subList["R_star"] = Rcpp::wrap(results_complete[i].R_star);
-            subList["p_se"] = Rcpp::wrap(results_complete[i].p_se);
-            // We p_ei and p_ir not generally defined in non-exponential case.  
-            if (transitionMode == "exponential")
-            {
-                subList["p_ei"] = Rcpp::wrap(results_complete[i].p_ei);
-                subList["p_ir"] = Rcpp::wrap(results_complete[i].p_ir);
-            }
-            if (hasSpatial)
-            {
-                subList["rho"] = Rcpp::wrap(results_complete[i].rho);
-            }
-            subList["beta"] = Rcpp::wrap(results_complete[i].beta);
-            subList["X"] = Rcpp::wrap(results_complete[i].X);
-            if (hasReinfection)
-            {
-                // TODO: output reinfection info
-            }
-            subList["result"] = Rcpp::wrap(results_complete[i].result);
-            simulationResults[std::to_string(i)] = subList;
+            simulationResults[std::to_string(i)] = wrapSimulationResult(results_complete[i]);
         }
         outList["simulationResults"] = simulationResults;
     }
@@ -252,14 +252,9 @@ Rcpp::List spatialSEIRModel::sample_DelMoral2012(int nSample, int vb,
         Rcpp::stop("Disparate simulation and particle size temporarily disabled\n");
     }
     const int maxBatches= samplingControlInstance -> max_batches;
-    const bool hasReinfection = (reinfectionModelInstance -> 
-            betaPriorPrecision)(0) > 0;
-    const bool hasSpatial = (dataModelInstance -> Y).cols() > 1;
-
-    std::string transitionMode = transitionPriorsInstance -> mode;   
-
     double e0 = std::numeric_limits<double>::infinity();
     double e1 = std::numeric_limits<double>::infinity();
+    Eigen::MatrixXd next_proposal_params;
 
     int i,j;
     int iteration;
@@ -411,24 +406,36 @@ Rcpp::List spatialSEIRModel::sample_DelMoral2012(int nSample, int vb,
 
 
 
-        // Until all < eps
+        // Until all < eps. Each batch after the first is proposed while the 
+        // one before it simulates.
         int currentIdx = 0;
         int nBatches = 0;
+        if (maxBatches > 0)
+        {
+            preproposal_params = proposal_cache;
+            proposeParams(&preproposal_params, 
+                          &tau,
+                          generator);     
+            begin_simulations(preproposal_params, sim_atom, &preproposal_results, 
+                    &results_complete);
+        }
         while (currentIdx < Npart && 
                nBatches < maxBatches)
         {
-           preproposal_params = proposal_cache;
-           proposeParams(&preproposal_params, 
-                         &tau,
-                         generator);     
-
-           run_simulations(preproposal_params, sim_atom, &preproposal_results, 
-                   &results_complete);
-           auto mins = preproposal_results.rowwise().minCoeff();
+           if (nBatches + 1 < maxBatches)
+           {
+               next_proposal_params = proposal_cache;
+               proposeParams(&next_proposal_params, 
+                             &tau,
+                             generator);     
+           }
 
+           // Results are tested in submission order as they arrive, and 
+           // the rest of the batch is abandoned once enough are accepted.
            for (i = 0; i < Nsim && currentIdx < Npart; i++)
            {
-               if (mins(i) < e1)
+               await_simulation(i);
+               if (preproposal_results.row(i).minCoeff() < e1)
                {
                    proposed_param_matrix.row(currentIdx) = 
                        preproposal_params.row(i);
@@ -437,12 +444,22 @@ Rcpp::List spatialSEIRModel::sample_DelMoral2012(int nSample, int vb,
                    currentIdx++;
                }
            }
+           if (i < Nsim)
+           {
+               cancel_simulations();
+           }
            if (currentIdx < Npart && verbose > 1)
            {
                 Rcpp::Rcout << "  batch " << nBatches << ", " << currentIdx << 
                     "/" << Npart << " accepted\n";
            }
            nBatches ++;
+           if (currentIdx < Npart && nBatches < maxBatches)
+           {
+               preproposal_params.swap(next_proposal_params);
+               begin_simulations(preproposal_params, sim_atom, 
+                       &preproposal_results, &results_complete);
+           }
         }
         if (currentIdx + 1 < results_double.rows())
         {
@@ -518,36 +535,7 @@ Rcpp::List spatialSEIRModel::sample_DelMoral2012(int nSample, int vb,
         // a regular data frame from the list.
         for (i = 0; i < (int) results_complete.size(); i++)
         {
-            Rcpp::List subList;
-            subList["S"] = Rcpp::wrap(results_complete[i].S);
-            subList["E"] = Rcpp::wrap(results_complete[i].E);
-            subList["I"] = Rcpp::wrap(results_complete[i].I);
-            subList["R"] = Rcpp::wrap(results_complete[i].R);
-
-            subList["S_star"] = Rcpp::wrap(results_complete[i].S_star);
-            subList["E_star"] = Rcpp::wrap(results_complete[i].E_star);
-            subList["I_star"] = Rcpp::wrap(results_complete[i].I_star);
-            subList["R_star"] = Rcpp::wrap(results_complete[i].R_star);
-            subList["p_se"] = Rcpp::wrap(results_complete[i].p_se);
-            // We p_ei and p_ir not generally defined in non-exponential case.  
-            if (transitionMode == "exponential")
-            {
-                subList["p_ei"] = Rcpp::wrap(results_complete[i].p_ei);
-                subList["p_ir"] = Rcpp::wrap(results_complete[i].p_ir);
-            }
-
-            if (hasSpatial)
-            {
-                subList["rho"] = Rcpp::wrap(results_complete[i].rho);
-            }
-            subList["beta"] = Rcpp::wrap(results_complete[i].beta);
-            subList["X"] = Rcpp::wrap(results_complete[i].X);
-            if (hasReinfection)
-            {
-                // TODO: output reinfection info
-            }
-            subList["result"] = Rcpp::wrap(results_complete[i].result);
-            outList[std::to_string(i)] = subList;
+            outList[std::to_string(i)] = wrapSimulationResult(results_complete[i]);
         }
     }
     else if (sim_type_atom == sim_atom)
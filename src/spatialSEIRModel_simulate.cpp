@@ -25,21 +25,14 @@ Rcpp::List spatialSEIRModel::sample_Simulate(int nSample,
         Rcpp::stop("Simulation requires initialized parameters");
     }
 
-    const bool hasReinfection = (reinfectionModelInstance -> 
-            betaPriorPrecision)(0) > 0;
-    const bool hasSpatial = (dataModelInstance -> Y).cols() > 1;
-
-    std::string transitionMode = transitionPriorsInstance -> mode;   
-
     int Naccept = 0;
     int batch;
     int i;
-    samplingControlInstance -> m = 1;
-    results_double = Eigen::MatrixXd::Zero(param_matrix.rows(), 1);
+    results_double = Eigen::MatrixXd::Zero(param_matrix.rows(), 
+                                           samplingControlInstance -> m);
     results_complete = std::vector<simulationResultSet>();
 
     results_complete.clear();
-    result_idx.clear();
 
     std::vector<simulationResultSet> finalResults = std::vector<simulationResultSet>();
     for (batch = 0; batch < samplingControlInstance -> max_batches &&
@@ -85,35 +78,7 @@ Rcpp::List spatialSEIRModel::sample_Simulate(int nSample,
     // a regular data frame from the list.
     for (i = 0; i < (int) results_complete.size(); i++)
     {
-        Rcpp::List subList;
-        subList["S"] = Rcpp::wrap(results_complete[i].S);
-        subList["E"] = Rcpp::wrap(results_complete[i].E);
-        subList["I"] = Rcpp::wrap(results_complete[i].I);
-        subList["R"] = Rcpp::wrap(results_complete[i].R);
-
-        subList["S_star"] = Rcpp::wrap(results_complete[i].S_star);
-        subList["E_star"] = Rcpp::wrap(results_complete[i].E_star);
-        subList["I_star"] = Rcpp::wrap(results_complete[i].I_star);
-        subList["R_star"] = Rcpp::wrap(results_complete[i].R_star);
-        subList["p_se"] = Rcpp::wrap(results_complete[i].p_se);
-        // We p_ei and p_ir not generally defined in non-exponential case.  
-        if (transitionMode == "exponential")
-        {
-            subList["p_ei"] = Rcpp::wrap(results_complete[i].p_ei);
-            subList["p_ir"] = Rcpp::wrap(results_complete[i].p_ir);
-        }
-        if (hasSpatial)
-        {
-            subList["rho"] = Rcpp::wrap(results_complete[i].rho);
-        }
-        subList["beta"] = Rcpp::wrap(results_complete[i].beta);
-        subList["X"] = Rcpp::wrap(results_complete[i].X);
-        if (hasReinfection)
-        {
-            // TODO: output reinfection info
-        }
-        subList["result"] = Rcpp::wrap(results_complete[i].result);
-        outList[std::to_string(i)] = subList;
+        outList[std::to_string(i)] = wrapSimulationResult(results_complete[i]);
     }
     return(outList);
 }
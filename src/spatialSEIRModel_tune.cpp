@@ -0,0 +1,132 @@
+#include <Rcpp.h>
+#include <Eigen/Core>
+#include <RcppEigen.h>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <spatialSEIRModel.hpp>
+#include <samplingControl.hpp>
+#include <SEIRSimNodes.hpp>
+
+/** Simulate rows [0, n) of params with pool, returning the wall time taken
+ * in seconds. An interrupt is raised in R.*/
+static double timeCalibrationRound(NodePool& pool,
+                                   const Eigen::MatrixXd& params,
+                                   int n)
+{
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    const int blockSize = pool.linearPredictorBlockSize();
+    pool.resetCompletion(n);
+    for (int first = 0; first < n; first += blockSize)
+    {
+        blockFuture block = pool.submitBlock(sim_task, &params, first,
+                                             std::min(blockSize, n - first));
+        if (!block.wait())
+        {
+            throw Rcpp::internal::InterruptedException();
+        }
+    }
+    return(std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start).count());
+}
+
+void spatialSEIRModel::autoTune(std::shared_ptr<const simulationModelData> modelData)
+{
+    samplingControl& control = *samplingControlInstance;
+    const int maxCores = (control.backend == backend_serial ? 1 :
+                (control.CPU_cores > 0 ? control.CPU_cores :
+                    std::max(1, (int) std::thread::hardware_concurrency())));
+
+    // Calibration particles come from their own generator, so that tuning
+    // leaves the sampler's random numbers as they would be without it.
+    std::mt19937* sampler_generator = generator;
+    std::mt19937 calibration_generator(control.random_seed + 2);
+    generator = &calibration_generator;
+    Eigen::MatrixXd params = generateParamsPrior(AUTO_TUNE_MAX_PARTICLES);
+    generator = sampler_generator;
+
+    Eigen::MatrixXd results = Eigen::MatrixXd::Zero(params.rows(), control.m);
+    std::vector<simulationResultSet> result_sets;
+    std::vector<std::string> no_remotes;
+    control.tuned_cores.clear();
+    control.tuned_throughput.clear();
+
+    // One core: double the round until it is long enough to time
+    double elapsed = 0.0;
+    double total = 0.0;
+    int n = 1;
+    {
+        NodePool pool(&results, &result_sets, 1, control.random_seed + 2,
+                      modelData, capture, control.pin_workers,
+                      control.spin_wait_us, control.backend, no_remotes);
+        while (true)
+        {
+            elapsed = timeCalibrationRound(pool, params, n);
+            total += elapsed;
+            if (elapsed >= AUTO_TUNE_ROUND_SECONDS ||
+                    n == AUTO_TUNE_MAX_PARTICLES)
+            {
+                break;
+            }
+            n = std::min(2*n, AUTO_TUNE_MAX_PARTICLES);
+        }
+    }
+    control.tuned_simulation_seconds = elapsed/n;
+    control.tuned_cores.push_back(1);
+    control.tuned_throughput.push_back(n/elapsed);
+
+    // More cores: double them while throughput keeps up
+    bool out_of_time = false;
+    int cores = 1;
+    while (cores < maxCores)
+    {
+        if (total >= AUTO_TUNE_MAX_SECONDS)
+        {
+            out_of_time = true;
+            break;
+        }
+        cores = std::min(2*cores, maxCores);
+        n = (int) std::min((double) AUTO_TUNE_MAX_PARTICLES, std::max(
+                    (double) AUTO_TUNE_TASKS_PER_CORE*cores,
+                    std::ceil(AUTO_TUNE_ROUND_SECONDS*cores/
+                              control.tuned_simulation_seconds)));
+        NodePool pool(&results, &result_sets, cores, control.random_seed + 2,
+                      modelData, capture, control.pin_workers,
+                      control.spin_wait_us, control.backend, no_remotes);
+        elapsed = timeCalibrationRound(pool, params, n);
+        total += elapsed;
+        control.tuned_cores.push_back(cores);
+        control.tuned_throughput.push_back(n/elapsed);
+        if (control.tuned_throughput.back() < AUTO_TUNE_MIN_GAIN*
+                control.tuned_throughput[control.tuned_throughput.size() - 2])
+        {
+            break;
+        }
+    }
+
+    // Untried core counts are assumed to scale as well as the last tried
+    std::vector<int> candidates = control.tuned_cores;
+    std::vector<double> throughput = control.tuned_throughput;
+    if (out_of_time)
+    {
+        candidates.push_back(maxCores);
+        throughput.push_back(throughput.back()*maxCores/cores);
+    }
+    const double best = *std::max_element(throughput.begin(), throughput.end());
+    unsigned int chosen = 0;
+    while (throughput[chosen] < AUTO_TUNE_EFFICIENCY*best)
+    {
+        chosen++;
+    }
+
+    control.CPU_cores = candidates[chosen];
+    const double batch = std::min((double) AUTO_TUNE_MAX_BATCH,
+            std::max((double) AUTO_TUNE_TASKS_PER_CORE*control.CPU_cores,
+                     std::ceil(control.target_batch_seconds*throughput[chosen])));
+    // Whole rounds of the chosen cores
+    control.batch_size = control.CPU_cores*((int) std::ceil(
+                batch/control.CPU_cores));
+    control.init_batch_size = control.batch_size;
+}
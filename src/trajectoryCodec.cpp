@@ -0,0 +1,86 @@
+#include <Rcpp.h>
+#include <cstdint>
+#include <trajectoryCodec.hpp>
+
+static inline void putVarint(std::uint32_t value, 
+                             std::vector<unsigned char>& out)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((unsigned char) (value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((unsigned char) value);
+}
+
+void encodeTransitionCounts(const Eigen::MatrixXi& counts,
+                            std::vector<unsigned char>& out)
+{
+    int i, j;
+    std::int32_t previous, delta;
+    out.clear();
+    out.reserve(counts.size() + counts.size()/4);
+    for (j = 0; j < counts.cols(); j++)
+    {
+        previous = 0;
+        for (i = 0; i < counts.rows(); i++)
+        {
+            delta = counts(i,j) - previous;
+            previous = counts(i,j);
+            // zigzag: small negative deltas map to small unsigned values
+            putVarint(((std::uint32_t) delta << 1) ^ (std::uint32_t) (delta >> 31),
+                      out);
+        }
+    }
+}
+
+Eigen::MatrixXi decodeTransitionCounts(const unsigned char* bytes,
+                                       size_t nBytes,
+                                       int nrow,
+                                       int ncol)
+{
+    Eigen::MatrixXi counts(nrow, ncol);
+    size_t pos = 0;
+    int i, j, shift;
+    std::uint32_t value;
+    std::int32_t previous;
+    for (j = 0; j < ncol; j++)
+    {
+        previous = 0;
+        for (i = 0; i < nrow; i++)
+        {
+            value = 0;
+            shift = 0;
+            do
+            {
+                if (pos >= nBytes || shift > 28)
+                {
+                    Rcpp::stop("Corrupt or truncated trajectory encoding.");
+                }
+                value |= ((std::uint32_t) (bytes[pos] & 0x7f)) << shift;
+                shift += 7;
+            } while (bytes[pos++] & 0x80);
+            previous += (std::int32_t) (value >> 1) ^ -((std::int32_t) (value & 1));
+            counts(i,j) = previous;
+        }
+    }
+    return(counts);
+}
+
+// [[Rcpp::export]]
+Rcpp::IntegerVector decode_transition_counts(Rcpp::RawVector bytes,
+                                             Rcpp::IntegerVector dims)
+{
+    int i;
+    int ncol = 1;
+    for (i = 1; i < dims.size(); i++)
+    {
+        ncol *= dims[i];
+    }
+    Eigen::MatrixXi counts = decodeTransitionCounts(bytes.begin(), 
+                                                    bytes.size(),
+                                                    dims[0], ncol);
+    Rcpp::IntegerVector out(counts.data(), counts.data() + counts.size());
+    out.attr("dim") = dims;
+    return(out);
+}
@@ -0,0 +1,175 @@
+#include <workerPlacement.hpp>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+#ifdef __linux__
+// Parse a sysfs CPU list such as "0-3,8-11"
+static std::vector<int> parseCPUList(const std::string& list)
+{
+    std::vector<int> out;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        if (item.empty() || item[0] == '\n')
+        {
+            continue;
+        }
+        std::size_t dash = item.find('-');
+        int first = std::atoi(item.substr(0, dash).c_str());
+        int last = (dash == std::string::npos ? first
+                                              : std::atoi(item.substr(dash + 1).c_str()));
+        for (int cpu = first; cpu <= last; cpu++)
+        {
+            out.push_back(cpu);
+        }
+    }
+    return(out);
+}
+#endif
+
+workerPlacement::workerPlacement()
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        node_cpus.push_back(std::vector<int>());
+        return;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            allowed_cpus.push_back(cpu);
+        }
+    }
+    DIR* nodeDir = opendir("/sys/devices/system/node");
+    if (nodeDir != NULL)
+    {
+        struct dirent* entry;
+        std::vector<std::pair<int, std::vector<int> > > nodes;
+        while ((entry = readdir(nodeDir)) != NULL)
+        {
+            std::string name(entry -> d_name);
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+                    name.find_first_not_of("0123456789", 4) != std::string::npos)
+            {
+                continue;
+            }
+            std::ifstream cpulist(("/sys/devices/system/node/" + name +
+                                   "/cpulist").c_str());
+            std::string list;
+            std::getline(cpulist, list);
+            std::vector<int> cpus;
+            std::vector<int> listed = parseCPUList(list);
+            for (unsigned int i = 0; i < listed.size(); i++)
+            {
+                if (CPU_ISSET(listed[i], &allowed))
+                {
+                    cpus.push_back(listed[i]);
+                }
+            }
+            if (!cpus.empty())
+            {
+                nodes.push_back(std::make_pair(std::atoi(name.c_str() + 4), cpus));
+            }
+        }
+        closedir(nodeDir);
+        std::sort(nodes.begin(), nodes.end());
+        for (unsigned int i = 0; i < nodes.size(); i++)
+        {
+            node_cpus.push_back(nodes[i].second);
+        }
+    }
+    if (node_cpus.empty())
+    {
+        // No NUMA information: one node holding every allowed CPU
+        node_cpus.push_back(allowed_cpus);
+    }
+#else
+    node_cpus.push_back(std::vector<int>());
+#endif
+}
+
+const workerPlacement& workerPlacement::instance()
+{
+    static workerPlacement placement;
+    return(placement);
+}
+
+int workerPlacement::numaNodes() const
+{
+    return((int) node_cpus.size());
+}
+
+int workerPlacement::nodeForWorker(int worker_idx) const
+{
+    return(worker_idx % numaNodes());
+}
+
+bool workerPlacement::pinWorker(std::thread::native_handle_type thread,
+                                int worker_idx) const
+{
+#ifdef __linux__
+    const std::vector<int>& cpus = node_cpus[nodeForWorker(worker_idx)];
+    if (cpus.empty())
+    {
+        return(false);
+    }
+    cpu_set_t target;
+    CPU_ZERO(&target);
+    CPU_SET(cpus[(worker_idx/numaNodes()) % cpus.size()], &target);
+    return(pthread_setaffinity_np(thread, sizeof(target), &target) == 0);
+#else
+    return(false);
+#endif
+}
+
+bool workerPlacement::unpinWorker(std::thread::native_handle_type thread) const
+{
+#ifdef __linux__
+    if (allowed_cpus.empty())
+    {
+        return(false);
+    }
+    cpu_set_t target;
+    CPU_ZERO(&target);
+    for (unsigned int i = 0; i < allowed_cpus.size(); i++)
+    {
+        CPU_SET(allowed_cpus[i], &target);
+    }
+    return(pthread_setaffinity_np(thread, sizeof(target), &target) == 0);
+#else
+    return(false);
+#endif
+}
+
+bool workerPlacement::pinToNode(int node) const
+{
+#ifdef __linux__
+    const std::vector<int>& cpus = node_cpus[node];
+    if (cpus.empty())
+    {
+        return(false);
+    }
+    cpu_set_t target;
+    CPU_ZERO(&target);
+    for (unsigned int i = 0; i < cpus.size(); i++)
+    {
+        CPU_SET(cpus[i], &target);
+    }
+    return(pthread_setaffinity_np(pthread_self(), sizeof(target), &target) == 0);
+#else
+    return(false);
+#endif
+}